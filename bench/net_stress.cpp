@@ -0,0 +1,119 @@
+// Stress test for net::client from many threads at once. Each thread owns
+// one client and posts a small JSON body over a keep-alive connection for a
+// fixed time; the requests per second at each thread count show how the net
+// layer scales across cores. Without a URL, replies come from an in-process
+// net::server on 127.0.0.1:PORT, which competes for the same cores, so point
+// it at a server on another machine for the cleanest numbers.
+//
+// Build and run from the repository root, with the g++ command on one line:
+//   mkdir -p ./build
+//   g++ -o ./build/net_stress -O3 -pthread bench/net_stress.cpp code/net.cpp
+//       code/server.cpp -lcurl -lz -I .
+//   ./build/net_stress [SECONDS] [MAX_THREADS] [PORT | URL]
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include "code/net.h"
+#include "code/server.h"
+
+static void serve(net::server& listener)
+{
+    while (true)
+    {
+        std::thread(
+            [conn = listener.accept()]() mutable
+            {
+                net::incoming_request request;
+                while (conn.read_request(request))
+                {
+                    if (!conn.send_response(
+                            200, {{"Content-Type", "application/json"}},
+                            "{\"ok\":true}") ||
+                        !request.keep_alive())
+                        break;
+                }
+            })
+            .detach();
+    }
+}
+
+struct step_result
+{
+    size_t requests = 0;
+    size_t failures = 0;
+};
+
+static step_result run_step(const std::string& url, unsigned threads,
+                            double seconds)
+{
+    std::atomic<bool>        stop{false};
+    std::atomic<size_t>      requests{0}, failures{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++)
+    {
+        workers.emplace_back(
+            [&]()
+            {
+                net::client  client;
+                net::request req(url, net::http_method::POST);
+                req.set_string("{\"model\":\"bench\",\"input\":\"x\"}");
+                req.headers["Content-Type"] = "application/json";
+                size_t sent = 0, failed = 0;
+                while (!stop)
+                {
+                    net::response response = client.send(req);
+                    sent++;
+                    if (response.curl_code != CURLE_OK ||
+                        response.response_code != 200)
+                        failed++;
+                }
+                requests += sent;
+                failures += failed;
+            });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& worker : workers)
+        worker.join();
+    return {requests, failures};
+}
+
+int main(int argc, char** argv)
+{
+    double      seconds     = argc > 1 ? atof(argv[1]) : 2.0;
+    unsigned    max_threads = argc > 2 ? atoi(argv[2])
+                                       : std::thread::hardware_concurrency();
+    std::string target      = argc > 3 ? argv[3] : "8799";
+    if (seconds <= 0 || max_threads == 0)
+    {
+        fprintf(stderr, "Usage: %s [SECONDS] [MAX_THREADS] [PORT | URL]\n",
+                argv[0]);
+        return 1;
+    }
+
+    std::string url = target;
+    if (target.find("://") == std::string::npos)
+    {
+        static net::server listener("127.0.0.1:" + target);
+        std::thread(serve, std::ref(listener)).detach();
+        url = "http://127.0.0.1:" + target + "/v1/embeddings";
+    }
+
+    printf("%-8s %12s %10s %9s\n", "threads", "requests/s", "speedup",
+           "failures");
+    double base = 0;
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+    {
+        step_result result = run_step(url, threads, seconds);
+        double      rate   = result.requests / seconds;
+        if (threads == 1)
+            base = rate;
+        printf("%-8u %12.0f %9.2fx %9zu\n", threads, rate,
+               base > 0 ? rate / base : 0.0, result.failures);
+    }
+    return 0;
+}
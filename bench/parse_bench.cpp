@@ -0,0 +1,81 @@
+// Times cli::prompt::parse against wordexp(3), which it replaced for
+// splitting command lines into arguments. Each case parses the same line
+// repeatedly and reads the first argument back; the table shows the mean
+// time per line for both and how many times faster the tokenizer is.
+// wordexp forks a shell for command substitution, so that case runs fewer
+// iterations; parse refuses it, so its column times the rejection.
+//
+// Build and run from the repository root, with the g++ command on one line:
+//   mkdir -p ./build
+//   g++ -o ./build/parse_bench -O3 bench/parse_bench.cpp code/cli.cpp
+//       -lreadline -I .
+//   ./build/parse_bench [ITERATIONS]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <wordexp.h>
+#include "code/cli.h"
+
+struct bench_case
+{
+    const char* line;
+    size_t      divisor; // Fewer iterations for lines that make wordexp fork
+};
+
+template <typename F> static double time_per_call(size_t iterations, F&& f)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+        f();
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char** argv)
+{
+    size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 200000;
+    if (iterations == 0)
+    {
+        fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+        return 1;
+    }
+
+    const bench_case cases[] = {
+        {":model gpt-4.1", 1},
+        {":file \"a b.txt\" ~/x $HOME/y", 1},
+        {":file *.txt", 1},
+        {":file $(echo x) y", 1000},
+    };
+
+    cli::prompt prompt;
+    size_t      sink = 0; // Keeps the results live
+    printf("%-30s %14s %14s %9s\n", "line", "parse ns", "wordexp ns",
+           "speedup");
+    for (const bench_case& c : cases)
+    {
+        auto tokenize = [&]()
+        {
+            prompt.reset_error_flags();
+            if (prompt.parse(c.line) > 0)
+                sink += prompt.get_next_arg().size();
+        };
+        auto expand = [&]()
+        {
+            wordexp_t words;
+            if (wordexp(c.line, &words, 0) == 0)
+            {
+                if (words.we_wordc > 0)
+                    sink += words.we_wordv[0][0];
+                wordfree(&words);
+            }
+        };
+        size_t n    = iterations / c.divisor ? iterations / c.divisor : 1;
+        double ours = time_per_call(n, tokenize);
+        double libc = time_per_call(n, expand);
+        printf("%-30s %14.0f %14.0f %8.1fx\n", c.line, ours, libc,
+               ours > 0 ? libc / ours : 0.0);
+    }
+    return sink == 0;
+}
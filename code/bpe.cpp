@@ -0,0 +1,196 @@
+#include "bpe.h"
+#include "io.h"
+#include <stdexcept>
+#include <limits>
+
+namespace
+{
+constexpr uint32_t NO_RANK = std::numeric_limits<uint32_t>::max();
+
+struct base64_table
+{
+    int8_t value[256];
+    constexpr base64_table() : value()
+    {
+        for (int c = 0; c < 256; c++)
+            value[c] = -1;
+        const char* alphabet =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (int i = 0; i < 64; i++)
+            value[static_cast<unsigned char>(alphabet[i])] = i;
+    }
+};
+
+constexpr base64_table BASE64;
+
+bool base64_decode(std::string_view text, std::string& out)
+{
+    out.clear();
+    uint32_t buffer = 0;
+    int      bits   = 0;
+    for (char c : text)
+    {
+        if (c == '=')
+            break;
+        int8_t v = BASE64.value[static_cast<unsigned char>(c)];
+        if (v < 0)
+            return false;
+        buffer = (buffer << 6) | static_cast<uint32_t>(v);
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back(static_cast<char>((buffer >> bits) & 0xFF));
+        }
+    }
+    return true;
+}
+} // namespace
+
+bpe::encoder::encoder(const std::string& path)
+{
+    io::mapping      file(path);
+    std::string_view text = file.view();
+    std::string      token;
+    size_t           line_number = 0;
+    while (!text.empty())
+    {
+        size_t           end  = text.find('\n');
+        std::string_view line = text.substr(0, end);
+        text = end == std::string_view::npos ? std::string_view()
+                                             : text.substr(end + 1);
+        line_number++;
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line.empty())
+            continue;
+
+        size_t space = line.find(' ');
+        if (space == std::string_view::npos ||
+            !base64_decode(line.substr(0, space), token))
+            throw std::runtime_error("Malformed vocabulary line " +
+                                     std::to_string(line_number) + " in '" +
+                                     path + "'");
+        uint32_t rank = static_cast<uint32_t>(
+            std::stoul(std::string(line.substr(space + 1))));
+        if (rank >= tokens_.size())
+            tokens_.resize(rank + 1);
+        tokens_[rank] = token;
+    }
+
+    // Keys view into tokens_, which is never resized after this point.
+    ranks_.reserve(tokens_.size());
+    for (size_t rank = 0; rank < tokens_.size(); rank++)
+    {
+        if (!tokens_[rank].empty())
+            ranks_.emplace(tokens_[rank], static_cast<uint32_t>(rank));
+    }
+    if (tokens_.size() > O200K_MIN_SIZE)
+        pattern_ = pattern::O200K;
+}
+
+template <typename F>
+void bpe::encoder::merge(std::string_view piece, F&& emit_token) const
+{
+    auto whole = ranks_.find(piece);
+    if (whole != ranks_.end())
+    {
+        emit_token(whole->second);
+        return;
+    }
+
+    // Byte pair merge as in tiktoken: each part stores its start offset and
+    // the rank of merging it with the part after it.
+    std::vector<std::pair<size_t, uint32_t>> parts;
+    parts.reserve(piece.size() + 1);
+    auto rank_of = [&](size_t start, size_t end)
+    {
+        auto found = ranks_.find(piece.substr(start, end - start));
+        return found == ranks_.end() ? NO_RANK : found->second;
+    };
+    for (size_t i = 0; i + 1 < piece.size(); i++)
+        parts.emplace_back(i, rank_of(i, i + 2));
+    parts.emplace_back(piece.size() - 1, NO_RANK);
+    parts.emplace_back(piece.size(), NO_RANK);
+
+    auto merged_rank = [&](size_t i)
+    {
+        return i + 3 < parts.size()
+                   ? rank_of(parts[i].first, parts[i + 3].first)
+                   : NO_RANK;
+    };
+
+    while (true)
+    {
+        uint32_t min_rank  = NO_RANK;
+        size_t   min_index = 0;
+        for (size_t i = 0; i + 1 < parts.size(); i++)
+        {
+            if (parts[i].second < min_rank)
+            {
+                min_rank  = parts[i].second;
+                min_index = i;
+            }
+        }
+        if (min_rank == NO_RANK)
+            break;
+        if (min_index > 0)
+            parts[min_index - 1].second = merged_rank(min_index - 1);
+        parts[min_index].second = merged_rank(min_index);
+        parts.erase(parts.begin() + min_index + 1);
+    }
+
+    for (size_t i = 0; i + 1 < parts.size(); i++)
+    {
+        uint32_t rank = rank_of(parts[i].first, parts[i + 1].first);
+        if (rank != NO_RANK)
+        {
+            emit_token(rank);
+        }
+        else
+        {
+            // Bytes missing from the vocabulary still cost a token each.
+            for (size_t b = parts[i].first; b < parts[i + 1].first; b++)
+                emit_token(NO_RANK);
+        }
+    }
+}
+
+std::vector<uint32_t> bpe::encoder::encode(std::string_view text) const
+{
+    std::vector<uint32_t> tokens;
+    pre_tokenize(text,
+                 [&](std::string_view piece)
+                 { merge(piece, [&](uint32_t t) { tokens.push_back(t); }); },
+                 pattern_);
+    return tokens;
+}
+
+size_t bpe::encoder::count(std::string_view text)
+{
+    size_t total = 0;
+    pre_tokenize(
+        text,
+        [&](std::string_view piece)
+        {
+            if (piece.size() == 1)
+            {
+                total++;
+                return;
+            }
+            auto cached = piece_counts_.find(std::string(piece));
+            if (cached != piece_counts_.end())
+            {
+                total += cached->second;
+                return;
+            }
+            uint32_t tokens = 0;
+            merge(piece, [&](uint32_t) { tokens++; });
+            if (piece_counts_.size() >= MAX_CACHED_PIECES)
+                piece_counts_.clear();
+            piece_counts_.emplace(piece, tokens);
+            total += tokens;
+        },
+        pattern_);
+    return total;
+}
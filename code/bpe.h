@@ -0,0 +1,226 @@
+#ifndef LJ_BPE_H
+#define LJ_BPE_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace bpe
+{
+// The split expressions of the two tiktoken vocabularies. o200k also breaks
+// words where lower case turns to upper and keeps contractions on the word.
+enum class pattern
+{
+    CL100K,
+    O200K
+};
+
+// Splits text the way the pattern's regular expression does, calling
+// piece_callback for every piece. Every non-ASCII code point is treated as a
+// letter of either case, which matches the expressions for nearly all real
+// text.
+template <typename F>
+void pre_tokenize(std::string_view text, F&& callback,
+                  pattern split = pattern::CL100K);
+
+class encoder
+{
+public:
+    encoder() = default;
+    // Loads a tiktoken rank file, one "<base64 bytes> <rank>" pair per line.
+    // Vocabularies past O200K_MIN_SIZE tokens split text the o200k way.
+    explicit encoder(const std::string& path);
+
+    bool                  empty() const { return ranks_.empty(); }
+    pattern               split_pattern() const { return pattern_; }
+    size_t                vocabulary_size() const { return tokens_.size(); }
+    std::vector<uint32_t> encode(std::string_view text) const;
+    // Not thread-safe, count() memoizes piece lengths.
+    size_t count(std::string_view text);
+
+private:
+    static constexpr size_t MAX_CACHED_PIECES = 1 << 16;
+    static constexpr size_t O200K_MIN_SIZE    = 150000;
+
+    template <typename F>
+    void merge(std::string_view piece, F&& emit_token) const;
+
+    std::vector<std::string>                     tokens_;
+    std::unordered_map<std::string_view, uint32_t> ranks_;
+    std::unordered_map<std::string, uint32_t>    piece_counts_;
+    pattern                                      pattern_ = pattern::CL100K;
+};
+
+namespace detail
+{
+enum char_class : uint8_t
+{
+    LETTER,
+    NUMBER,
+    SPACE,
+    NEWLINE,
+    OTHER
+};
+
+struct class_table
+{
+    char_class value[256];
+    constexpr class_table() : value()
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80)
+                value[c] = LETTER;
+            else if (c >= '0' && c <= '9')
+                value[c] = NUMBER;
+            else if (c == '\r' || c == '\n')
+                value[c] = NEWLINE;
+            else if (c == ' ' || c == '\t' || c == '\v' || c == '\f')
+                value[c] = SPACE;
+            else
+                value[c] = OTHER;
+        }
+    }
+};
+
+constexpr class_table CLASSES;
+
+inline char_class class_at(std::string_view text, size_t i)
+{
+    return CLASSES.value[static_cast<unsigned char>(text[i])];
+}
+
+inline bool is_space(char_class c) { return c == SPACE || c == NEWLINE; }
+
+inline size_t contraction_length(std::string_view text, size_t i)
+{
+    if (text[i] != '\'' || i + 1 >= text.size())
+        return 0;
+    auto lower = [&](size_t at)
+    { return at < text.size() ? (char)(text[at] | 0x20) : '\0'; };
+    char a = lower(i + 1), b = lower(i + 2);
+    if ((a == 'l' && b == 'l') || (a == 'v' && b == 'e') ||
+        (a == 'r' && b == 'e'))
+        return 3;
+    if (a == 's' || a == 'd' || a == 'm' || a == 't')
+        return 2;
+    return 0;
+}
+
+inline bool is_upper(std::string_view text, size_t i)
+{
+    unsigned char c = text[i];
+    return (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+inline bool is_lower(std::string_view text, size_t i)
+{
+    unsigned char c = text[i];
+    return (c >= 'a' && c <= 'z') || c >= 0x80;
+}
+
+// End of o200k's [\p{Lu}..]*[\p{Ll}..]+, or failing that
+// [\p{Lu}..]+[\p{Ll}..]*, from a letter at i.
+inline size_t cased_word_end(std::string_view text, size_t i)
+{
+    size_t upper_end = i;
+    while (upper_end < text.size() && is_upper(text, upper_end))
+        upper_end++;
+    size_t end = upper_end;
+    while (end < text.size() && is_lower(text, end))
+        end++;
+    if (end > upper_end)
+        return end;
+    // The upper case run backs off until a letter of either case can end
+    // the word, as the expression backtracks
+    for (size_t m = upper_end; m-- > i;)
+    {
+        if (!is_lower(text, m))
+            continue;
+        while (m < upper_end && is_lower(text, m))
+            m++;
+        return m;
+    }
+    return upper_end;
+}
+} // namespace detail
+
+template <typename F>
+void pre_tokenize(std::string_view text, F&& callback, pattern split)
+{
+    using namespace detail;
+    const size_t size = text.size();
+    size_t       i    = 0;
+    while (i < size)
+    {
+        size_t     start = i;
+        char_class c     = class_at(text, i);
+        size_t     length;
+
+        if (split == pattern::CL100K &&
+            (length = contraction_length(text, i)) != 0)
+        {
+            i += length;
+        }
+        else if (c == LETTER ||
+                 (c != NEWLINE && c != NUMBER && i + 1 < size &&
+                  class_at(text, i + 1) == LETTER))
+        {
+            // [^\r\n\p{L}\p{N}]? before the letters
+            if (c != LETTER)
+                i++;
+            if (split == pattern::O200K)
+            {
+                i = cased_word_end(text, i);
+                i += contraction_length(text, i);
+            }
+            else
+            {
+                while (i < size && class_at(text, i) == LETTER)
+                    i++;
+            }
+        }
+        else if (c == NUMBER)
+        {
+            // \p{N}{1,3}
+            size_t end = std::min(size, i + 3);
+            while (i < end && class_at(text, i) == NUMBER)
+                i++;
+        }
+        else if (c == OTHER ||
+                 (text[i] == ' ' && i + 1 < size &&
+                  class_at(text, i + 1) == OTHER))
+        {
+            // ' ?[^\s\p{L}\p{N}]+[\r\n]*', o200k also taking '/'
+            i++;
+            while (i < size && class_at(text, i) == OTHER)
+                i++;
+            while (i < size && (class_at(text, i) == NEWLINE ||
+                                (split == pattern::O200K && text[i] == '/')))
+                i++;
+        }
+        else
+        {
+            size_t end          = i;
+            size_t last_newline = std::string_view::npos;
+            while (end < size && is_space(class_at(text, end)))
+            {
+                if (class_at(text, end) == NEWLINE)
+                    last_newline = end;
+                end++;
+            }
+            if (last_newline != std::string_view::npos)
+                i = last_newline + 1; // \s*[\r\n]+
+            else if (end == size || end - i == 1)
+                i = end; // \s+(?!\S) at the end, or a lone \s+
+            else
+                i = end - 1; // \s+(?!\S) leaves one space for the next word
+        }
+        callback(text.substr(start, i - start));
+    }
+}
+} // namespace bpe
+
+#endif
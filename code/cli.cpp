@@ -1,5 +1,9 @@
 #include "cli.h"
 #include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <pwd.h>
+#include <unistd.h>
 
 namespace cli
 {
@@ -87,11 +91,7 @@ prompt::prompt()
 {
 }
 
-prompt::~prompt()
-{
-    if (args_allocated_)
-        wordfree(&args_);
-}
+prompt::~prompt() {}
 
 std::string prompt::get_error() const
 {
@@ -176,47 +176,224 @@ std::string prompt::get_next_arg()
         throw std::runtime_error("prompt::get_next_arg called before parse");
     if (args_allocated_)
     {
-        if (arg_index_ < args_.we_wordc)
-            next_arg_string = args_.we_wordv[arg_index_++];
+        if (arg_index_ < word_starts_.size())
+            next_arg_string = words_.c_str() + word_starts_[arg_index_++];
     }
     return next_arg_string;
 }
 
-size_t prompt::get_arg_count() { return args_.we_wordc; }
+size_t prompt::get_arg_count()
+{
+    return args_allocated_ ? word_starts_.size() : 0;
+}
 
-int prompt::parse()
+static bool is_name_char(char c, bool first)
 {
-    if (args_allocated_)
-        wordfree(&args_);
-    int      word_exp_err = wordexp(input_.c_str(), &args_, 0);
-    uint32_t error_code   = 0;
-    switch (word_exp_err)
-    {
-    case WRDE_NOSPACE:
-        throw std::bad_alloc();
-        break;
-    case WRDE_BADCHAR:
-        error_code = error::BADCHAR;
-        break;
-    case WRDE_BADVAL:
-        error_code = error::BADVAL;
-        break;
-    case WRDE_CMDSUB:
-        error_code = error::SUB;
-        break;
-    case WRDE_SYNTAX:
-        error_code = error::SYNTAX;
-        break;
-    default:
-        arg_index_      = 0;
-        args_allocated_ = true;
-        break;
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (!first && c >= '0' && c <= '9');
+}
+
+// $NAME or ${NAME} at input_[i], leaving i on its last character. Unset
+// variables and positional parameters expand to nothing, anything else after
+// '$' is literal.
+bool prompt::expand_variable(size_t& i)
+{
+    size_t start = i + 1, end;
+    if (start < input_.size() && input_[start] == '{')
+    {
+        end = input_.find('}', ++start);
+        if (end == std::string::npos || end == start)
+            return false;
+        i = end;
+    }
+    else
+    {
+        end = start;
+        while (end < input_.size() && is_name_char(input_[end], end == start))
+            end++;
+        if (end == start && start < input_.size() && input_[start] >= '0' &&
+            input_[start] <= '9')
+        {
+            i = start;
+            return true;
+        }
+        if (end == start)
+        {
+            words_ += '$';
+            return true;
+        }
+        i = end - 1;
+    }
+
+    char   name[256];
+    size_t length = std::min(end - start, sizeof(name) - 1);
+    memcpy(name, input_.data() + start, length);
+    name[length]      = '\0';
+    const char* value = getenv(name);
+    if (value)
+        words_ += value;
+    return true;
+}
+
+// ~ or ~user at the start of a word, up to the next '/'. Like wordexp, a
+// prefix with any quoted character is left alone, so ~'x' stays literal.
+void prompt::expand_tilde(size_t& i)
+{
+    size_t end = i + 1;
+    while (end < input_.size() && !strchr("/ \t\n", input_[end]))
+    {
+        if (strchr("'\"\\", input_[end]))
+        {
+            words_ += '~';
+            return;
+        }
+        end++;
+    }
+
+    const char* home = nullptr;
+    if (end == i + 1)
+    {
+        home = getenv("HOME");
+        if (!home)
+        {
+            struct passwd* pw = getpwuid(getuid());
+            home              = pw ? pw->pw_dir : nullptr;
+        }
+    }
+    else
+    {
+        std::string    user = input_.substr(i + 1, end - i - 1);
+        struct passwd* pw   = getpwnam(user.c_str());
+        home                = pw ? pw->pw_dir : nullptr;
+    }
+
+    if (home)
+    {
+        words_ += home;
+        i = end - 1;
+    }
+    else
+    {
+        words_ += '~';
     }
+}
 
-    if (word_exp_err != 0)
-        args_allocated_ = false;
+// Splits the input into words like a shell would, without running one:
+// quotes, backslash escapes, ~ and $VAR expansion. Unquoted expansions are
+// not split further and nothing is globbed. Command substitution and
+// unquoted shell operators are refused with the matching error flag.
+int prompt::parse()
+{
+    words_.clear();
+    word_starts_.clear();
+    words_.reserve(input_.size() + 1);
+    args_allocated_ = false;
+    arg_index_      = 0;
+
+    uint32_t error_code = 0;
+    bool     in_word    = false;
+    bool     quoted     = false; // An empty word only counts when quoted
+    char     quote      = 0;
+    auto     end_word   = [&]()
+    {
+        if (words_.size() == word_starts_.back() && !quoted)
+            word_starts_.pop_back();
+        else
+            words_ += '\0';
+        in_word = false;
+    };
+    for (size_t i = 0; i < input_.size() && !error_code; i++)
+    {
+        char c = input_[i];
+        if (!quote && (c == ' ' || c == '\t' || c == '\n'))
+        {
+            if (in_word)
+                end_word();
+            continue;
+        }
+        if (!in_word)
+        {
+            word_starts_.push_back(words_.size());
+            in_word = true;
+            quoted  = false;
+            if (c == '~' && !quote)
+            {
+                expand_tilde(i);
+                continue;
+            }
+        }
+
+        if (quote == '\'')
+        {
+            if (c == '\'')
+                quote = 0;
+            else
+                words_ += c;
+        }
+        else if (c == '\\')
+        {
+            if (++i == input_.size())
+            {
+                error_code = error::SYNTAX;
+                break;
+            }
+            char next = input_[i];
+            if (next == '\n')
+                continue;
+            // Inside double quotes a backslash only escapes $ ` " and itself
+            if (quote && !strchr("$`\"\\", next))
+                words_ += '\\';
+            words_ += next;
+        }
+        else if (c == '`' || (c == '$' && i + 1 < input_.size() &&
+                              input_[i + 1] == '('))
+        {
+            error_code = error::SUB;
+        }
+        else if (c == '$')
+        {
+            if (!expand_variable(i))
+                error_code = error::SYNTAX;
+        }
+        else if (c == '"')
+        {
+            quote  = quote ? 0 : '"';
+            quoted = true;
+        }
+        else if (quote)
+        {
+            words_ += c;
+        }
+        else if (c == '\'')
+        {
+            quote  = '\'';
+            quoted = true;
+        }
+        else if (strchr("|&;<>(){}", c))
+        {
+            error_code = error::BADCHAR;
+        }
+        else
+        {
+            words_ += c;
+        }
+    }
+    if (quote && !error_code)
+        error_code = error::SYNTAX;
+    if (in_word)
+        end_word();
 
     error_flags |= error_code;
-    return error_code ? -1 : args_.we_wordc;
+    if (error_code)
+        return -1;
+    args_allocated_ = true;
+    return word_starts_.size();
+}
+
+// Parses a line that did not come from read_line, such as a script line
+int prompt::parse(const std::string& line)
+{
+    input_ = line;
+    return parse();
 }
 } // namespace cli
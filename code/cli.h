@@ -2,7 +2,6 @@
 #define LJ_CLI_H
 
 #include <cstdint>
-#include <wordexp.h>
 #include <argp.h>
 #include <vector>
 #include <string>
@@ -60,16 +59,22 @@ public:
     std::string get_next_arg();
     size_t      get_arg_count();
     int         parse();
+    int         parse(const std::string& line);
     void        set_prompt(const std::string&) {}
     uint32_t    error_flags;
     bool        escape_mode;
     bool        keep_alive;
 
 private:
-    wordexp_t   args_;
-    std::string input_;
-    bool        args_allocated_;
-    size_t      arg_index_;
+    bool expand_variable(size_t& i);
+    void expand_tilde(size_t& i);
+
+    std::string         input_;
+    // Parsed words, each NUL terminated, reused between parses
+    std::string         words_;
+    std::vector<size_t> word_starts_;
+    bool                args_allocated_;
+    size_t              arg_index_;
 };
 template <typename T> class shell_args
 {
@@ -0,0 +1,221 @@
+#include "diff.h"
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+namespace
+{
+struct lines
+{
+    std::vector<std::string_view> text;
+    std::vector<size_t>           hash;
+};
+
+lines split(std::string_view text)
+{
+    lines  result;
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find('\n', start);
+        if (end == std::string_view::npos)
+            end = text.size();
+        std::string_view line = text.substr(start, end - start);
+        result.text.push_back(line);
+        result.hash.push_back(std::hash<std::string_view>()(line));
+        start = end + 1;
+    }
+    return result;
+}
+
+enum class op
+{
+    KEEP,
+    REMOVE,
+    ADD
+};
+
+struct edit
+{
+    op     kind;
+    size_t before_line;
+    size_t after_line;
+};
+
+bool same(const lines& a, size_t i, const lines& b, size_t j)
+{
+    return a.hash[i] == b.hash[j] && a.text[i] == b.text[j];
+}
+
+// Myers' O(ND) shortest edit script over a[lo_a, hi_a) and b[lo_b, hi_b).
+bool shortest_edit(const lines& a, size_t lo_a, size_t hi_a, const lines& b,
+                   size_t lo_b, size_t hi_b, size_t max_edits,
+                   std::vector<edit>& edits)
+{
+    const long n      = static_cast<long>(hi_a - lo_a);
+    const long m      = static_cast<long>(hi_b - lo_b);
+    const long max_d  = std::min<long>(n + m, static_cast<long>(max_edits));
+    const long offset = max_d + 1;
+
+    std::vector<long>              v(2 * offset + 1, 0);
+    std::vector<std::vector<long>> trace;
+    long                           found_d = -1;
+    for (long d = 0; d <= max_d && found_d < 0; d++)
+    {
+        // Only diagonals -d-1..d+1 are read back while tracing the path.
+        trace.emplace_back(v.begin() + (offset - d - 1),
+                           v.begin() + (offset + d + 2));
+        for (long k = -d; k <= d; k += 2)
+        {
+            long x;
+            if (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1]))
+                x = v[offset + k + 1];
+            else
+                x = v[offset + k - 1] + 1;
+            long y = x - k;
+            while (x < n && y < m && same(a, lo_a + x, b, lo_b + y))
+            {
+                x++;
+                y++;
+            }
+            v[offset + k] = x;
+            if (x >= n && y >= m)
+            {
+                found_d = d;
+                break;
+            }
+        }
+    }
+    if (found_d < 0)
+        return false;
+
+    std::vector<edit> reversed;
+    long              x = n, y = m;
+    for (long d = found_d; d > 0; d--)
+    {
+        const std::vector<long>& prev = trace[d];
+        const long               base = d + 1;
+        long                     k    = x - y;
+        long                     prev_k;
+        if (k == -d || (k != d && prev[base + k - 1] < prev[base + k + 1]))
+            prev_k = k + 1;
+        else
+            prev_k = k - 1;
+        long prev_x = prev[base + prev_k];
+        long prev_y = prev_x - prev_k;
+        while (x > prev_x && y > prev_y)
+        {
+            x--;
+            y--;
+            reversed.push_back({op::KEEP, lo_a + x, lo_b + y});
+        }
+        if (x == prev_x)
+            reversed.push_back({op::ADD, lo_a + x, lo_b + --y});
+        else
+            reversed.push_back({op::REMOVE, lo_a + --x, lo_b + y});
+    }
+    while (x > 0 && y > 0)
+    {
+        x--;
+        y--;
+        reversed.push_back({op::KEEP, lo_a + x, lo_b + y});
+    }
+    edits.insert(edits.end(), reversed.rbegin(), reversed.rend());
+    return true;
+}
+} // namespace
+
+bool diff::unified(std::string_view before, std::string_view after,
+                   const std::string& label, std::string& out, size_t context,
+                   size_t max_edits)
+{
+    lines a = split(before);
+    lines b = split(after);
+
+    // Edit loops usually touch a small region, so peel off the common prefix
+    // and suffix before running the quadratic worst-case search.
+    size_t prefix = 0;
+    while (prefix < a.text.size() && prefix < b.text.size() &&
+           same(a, prefix, b, prefix))
+        prefix++;
+    size_t suffix = 0;
+    while (suffix < a.text.size() - prefix && suffix < b.text.size() - prefix &&
+           same(a, a.text.size() - 1 - suffix, b, b.text.size() - 1 - suffix))
+        suffix++;
+
+    std::vector<edit> edits;
+    for (size_t i = 0; i < prefix; i++)
+        edits.push_back({op::KEEP, i, i});
+    if (!shortest_edit(a, prefix, a.text.size() - suffix, b, prefix,
+                       b.text.size() - suffix, max_edits, edits))
+        return false;
+    for (size_t i = suffix; i > 0; i--)
+        edits.push_back(
+            {op::KEEP, a.text.size() - i, b.text.size() - i});
+
+    std::string result = "--- a/" + label + "\n+++ b/" + label + "\n";
+    size_t      hunks  = 0;
+    size_t      i      = 0;
+    while (i < edits.size())
+    {
+        while (i < edits.size() && edits[i].kind == op::KEEP)
+            i++;
+        if (i == edits.size())
+            break;
+
+        // Grow the hunk until the gap to the next change exceeds 2 * context.
+        size_t start = i >= context ? i - context : 0;
+        size_t end   = i;
+        while (end < edits.size())
+        {
+            if (edits[end].kind != op::KEEP)
+            {
+                end++;
+                continue;
+            }
+            size_t run = end;
+            while (run < edits.size() && edits[run].kind == op::KEEP)
+                run++;
+            if (run == edits.size() || run - end > 2 * context)
+            {
+                end = std::min(edits.size(), end + context);
+                break;
+            }
+            end = run;
+        }
+
+        size_t before_count = 0, after_count = 0;
+        for (size_t j = start; j < end; j++)
+        {
+            if (edits[j].kind != op::ADD)
+                before_count++;
+            if (edits[j].kind != op::REMOVE)
+                after_count++;
+        }
+        size_t before_start = edits[start].before_line + (before_count ? 1 : 0);
+        size_t after_start  = edits[start].after_line + (after_count ? 1 : 0);
+        result += "@@ -" + std::to_string(before_start) + "," +
+                  std::to_string(before_count) + " +" +
+                  std::to_string(after_start) + "," +
+                  std::to_string(after_count) + " @@\n";
+        for (size_t j = start; j < end; j++)
+        {
+            const edit& e = edits[j];
+            if (e.kind == op::KEEP)
+                result.append(" ").append(a.text[e.before_line]);
+            else if (e.kind == op::REMOVE)
+                result.append("-").append(a.text[e.before_line]);
+            else
+                result.append("+").append(b.text[e.after_line]);
+            result += '\n';
+        }
+        i = end;
+        hunks++;
+    }
+    // Texts that differ only in what the lines leave out, such as the final
+    // newline, have no hunk to show
+    if (hunks == 0)
+        return false;
+    out = std::move(result);
+    return true;
+}
@@ -0,0 +1,22 @@
+#ifndef LJ_DIFF_H
+#define LJ_DIFF_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace diff
+{
+constexpr size_t CONTEXT_LINES = 3;
+constexpr size_t MAX_EDITS     = 1024;
+
+// Unified line diff from before to after, labelled a/<label> and b/<label>.
+// Returns false, leaving out untouched, when the texts need more than
+// max_edits line insertions and deletions to reconcile, or when their lines
+// are all the same.
+bool unified(std::string_view before, std::string_view after,
+             const std::string& label, std::string& out,
+             size_t context = CONTEXT_LINES, size_t max_edits = MAX_EDITS);
+} // namespace diff
+
+#endif
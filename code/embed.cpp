@@ -0,0 +1,507 @@
+#include "embed.h"
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <sys/stat.h>
+
+// The index file is the header, the files, the chunks, padding up to
+// VECTOR_ALIGN, one vector per chunk and then the string bytes, which start
+// with the model name.
+namespace
+{
+const char MAGIC[8] = {'J', 'P', 'V', 'E', 'C', '0', '0', '1'};
+
+struct file_header
+{
+    char     magic[8];
+    uint32_t dimension, file_count, chunk_count, model_size;
+    uint64_t vectors_offset, strings_offset, strings_size;
+};
+
+struct file_entry
+{
+    int64_t  mtime_sec, mtime_nsec;
+    uint64_t size, hash;
+    uint32_t path_offset, path_size, first_chunk, chunk_count;
+};
+
+struct chunk_entry
+{
+    uint64_t offset;
+    uint32_t size, first_line, line_count, file;
+};
+
+template <typename T> T record(const uint8_t* section, size_t i)
+{
+    T value;
+    memcpy(&value, section + i * sizeof(T), sizeof(T));
+    return value;
+}
+
+uint64_t fnv1a(std::string_view text)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text)
+        hash = (hash ^ c) * 1099511628211ull;
+    return hash;
+}
+
+size_t chunks_offset(const file_header& header)
+{
+    return sizeof(header) + header.file_count * sizeof(file_entry);
+}
+
+bool valid(const file_header& header, size_t size)
+{
+    size_t chunks_end = chunks_offset(header) +
+                        header.chunk_count * sizeof(chunk_entry);
+    return !memcmp(header.magic, MAGIC, sizeof(MAGIC)) &&
+           header.vectors_offset >= chunks_end &&
+           header.vectors_offset % embed::VECTOR_ALIGN == 0 &&
+           header.strings_offset ==
+               header.vectors_offset + (uint64_t)header.chunk_count *
+                                           header.dimension * sizeof(float) &&
+           header.strings_offset + header.strings_size == size &&
+           header.model_size <= header.strings_size;
+}
+
+// An index file from an earlier update, looked up by path.
+struct previous
+{
+    io::mapping                                 map;
+    file_header                                 header = {};
+    const uint8_t*                              base   = nullptr;
+    std::unordered_map<std::string, uint32_t> files;
+
+    previous(const std::string& path, const std::string& model)
+    {
+        if (path.empty())
+            return;
+        try
+        {
+            map = io::mapping(path);
+        }
+        catch (const std::exception&)
+        {
+            return;
+        }
+        if (map.size() < sizeof(header))
+            return;
+        memcpy(&header, map.data(), sizeof(header));
+        base = reinterpret_cast<const uint8_t*>(map.data());
+        // Vectors from another model are useless
+        if (!valid(header, map.size()) ||
+            std::string_view(map.data() + header.strings_offset,
+                             header.model_size) != model)
+            return;
+        for (uint32_t i = 0; i < header.file_count; i++)
+        {
+            file_entry entry = file(i);
+            files.emplace(std::string(map.data() + header.strings_offset +
+                                          entry.path_offset,
+                                      entry.path_size),
+                          i);
+        }
+    }
+
+    file_entry file(uint32_t i) const
+    {
+        return record<file_entry>(base + sizeof(header), i);
+    }
+
+    chunk_entry chunk(uint32_t i) const
+    {
+        return record<chunk_entry>(base + chunks_offset(header), i);
+    }
+
+    const float* vector(uint32_t i) const
+    {
+        return reinterpret_cast<const float*>(base + header.vectors_offset) +
+               (size_t)i * header.dimension;
+    }
+};
+} // namespace
+
+std::vector<embed::chunk> embed::split(std::string_view text)
+{
+    std::vector<chunk> chunks;
+    size_t             start = 0, line = 0;
+    while (start < text.size())
+    {
+        chunk  next;
+        size_t end   = start;
+        next.offset     = start;
+        next.first_line = line;
+        while (end < text.size() && next.line_count < CHUNK_LINES &&
+               end - start < CHUNK_BYTES)
+        {
+            size_t newline = text.find('\n', end);
+            size_t stop    = newline == std::string_view::npos ? text.size()
+                                                               : newline + 1;
+            // Long lines are cut, the rest of the line starting the next chunk
+            if (stop - start > CHUNK_BYTES && end > start)
+                break;
+            if (stop - end > CHUNK_BYTES)
+                stop = end + CHUNK_BYTES;
+            else
+                next.line_count++;
+            end = stop;
+        }
+        next.size = end - start;
+        line += next.line_count;
+        if (text.substr(start, next.size).find_first_not_of(" \t\r\n") !=
+            std::string_view::npos)
+            chunks.push_back(std::move(next));
+        start = end;
+    }
+    return chunks;
+}
+
+float embed::dot(const float* a, const float* b, size_t size)
+{
+    // Eight independent lanes, which the compiler maps onto whatever vector
+    // registers the target has
+    typedef float lanes __attribute__((vector_size(8 * sizeof(float))));
+    lanes  sum = {};
+    size_t i   = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        lanes x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        sum += x * y;
+    }
+    float total = 0;
+    for (size_t lane = 0; lane < 8; lane++)
+        total += sum[lane];
+    for (; i < size; i++)
+        total += a[i] * b[i];
+    return total;
+}
+
+void embed::normalize(std::vector<float>& vector)
+{
+    float length = std::sqrt(dot(vector.data(), vector.data(), vector.size()));
+    if (length > 0)
+    {
+        for (float& value : vector)
+            value /= length;
+    }
+}
+
+static embed::update_stats update_index(const std::string&           dir,
+                                        const embed::update_options& options,
+                                        const embed::embedder&       embed,
+                                        bool                         reuse)
+{
+    using namespace embed;
+    std::vector<std::string> unmatched;
+    std::vector<std::string> paths = io::expand_paths({dir}, unmatched);
+    if (!unmatched.empty())
+        throw std::runtime_error("No such directory '" + dir + "'");
+
+    std::string index_path = dir + "/" + INDEX_FILE_NAME;
+    previous    old(reuse ? index_path : "", options.model);
+
+    // Stored relative to dir, so the index holds however dir is spelled and
+    // wherever it is used from
+    std::string              prefix = dir.back() == '/' ? dir : dir + "/";
+    std::vector<std::string> names;
+    names.reserve(paths.size());
+    for (const auto& path : paths)
+        names.push_back(path.compare(0, prefix.size(), prefix) == 0
+                            ? path.substr(prefix.size())
+                            : path);
+
+    // Files whose size and mtime match keep their vectors unread
+    struct pending_file
+    {
+        file_entry               entry    = {};
+        int64_t                  old_file = -1;
+        std::vector<chunk>       chunks;
+        std::vector<std::string> texts;
+    };
+    std::vector<pending_file> files(paths.size());
+    std::vector<std::string>  to_read;
+    std::vector<size_t>       read_index;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        struct stat st = {};
+        stat(paths[i].c_str(), &st);
+        file_entry& entry = files[i].entry;
+        entry.mtime_sec   = st.st_mtim.tv_sec;
+        entry.mtime_nsec  = st.st_mtim.tv_nsec;
+        entry.size        = st.st_size;
+        auto found        = old.files.find(names[i]);
+        if (found != old.files.end())
+        {
+            file_entry before = old.file(found->second);
+            if (before.mtime_sec == entry.mtime_sec &&
+                before.mtime_nsec == entry.mtime_nsec &&
+                before.size == entry.size)
+            {
+                entry.hash        = before.hash;
+                files[i].old_file = found->second;
+                continue;
+            }
+        }
+        to_read.push_back(paths[i]);
+        read_index.push_back(i);
+    }
+
+    // The rest are hashed, and chunked when the content really changed
+    io::read_limits limits;
+    limits.max_file_size = options.max_file_size;
+    size_t next_read     = 0;
+    io::read_files(to_read, limits,
+                   [&](io::file_contents& contents)
+                   {
+                       size_t        i    = read_index[next_read++];
+                       pending_file& file = files[i];
+                       if (contents.status != io::read_status::OK)
+                           return;
+                       std::string_view text = contents.text();
+                       file.entry.hash       = fnv1a(text);
+                       auto found = old.files.find(names[i]);
+                       if (found != old.files.end() &&
+                           old.file(found->second).hash == file.entry.hash)
+                       {
+                           file.old_file = found->second;
+                           return;
+                       }
+                       file.chunks = split(text);
+                       for (const auto& c : file.chunks)
+                           file.texts.emplace_back(text.substr(c.offset,
+                                                               c.size));
+                   });
+
+    // Every chunk to embed, in file order; unreadable files drop out
+    std::vector<const std::string*> batch_texts;
+    for (auto& file : files)
+    {
+        for (const auto& text : file.texts)
+            batch_texts.push_back(&text);
+    }
+
+    std::vector<std::vector<float>> vectors(batch_texts.size());
+    size_t                          batch_size = std::max<size_t>(
+        options.batch_size, 1);
+    size_t               batch_count = (batch_texts.size() + batch_size - 1) /
+                                       batch_size;
+    std::atomic<size_t>  next_batch{0};
+    std::mutex           error_mutex;
+    std::exception_ptr   error;
+    std::vector<std::thread> workers;
+    unsigned worker_count = std::min<size_t>(std::max(options.workers, 1u),
+                                             batch_count);
+    for (unsigned w = 0; w < worker_count; w++)
+    {
+        workers.emplace_back(
+            [&]()
+            {
+                size_t batch;
+                while ((batch = next_batch++) < batch_count)
+                {
+                    size_t first = batch * batch_size;
+                    size_t last  = std::min(first + batch_size,
+                                            batch_texts.size());
+                    std::vector<std::string> texts;
+                    for (size_t i = first; i < last; i++)
+                        texts.push_back(*batch_texts[i]);
+                    try
+                    {
+                        auto result = embed(texts);
+                        if (result.size() != texts.size())
+                            throw std::runtime_error(
+                                "Embedding count mismatch");
+                        for (size_t i = first; i < last; i++)
+                            vectors[i] = std::move(result[i - first]);
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        if (!error)
+                            error = std::current_exception();
+                        next_batch = batch_count;
+                    }
+                }
+            });
+    }
+    for (auto& worker : workers)
+        worker.join();
+    if (error)
+        std::rethrow_exception(error);
+
+    uint32_t dimension = vectors.empty() ? old.header.dimension
+                                         : vectors.front().size();
+    for (auto& vector : vectors)
+    {
+        if (vector.size() != dimension || dimension == 0)
+            throw std::runtime_error("Embeddings of mixed dimensions");
+        normalize(vector);
+    }
+    // Same model name but different vectors, so start over
+    if (!vectors.empty() && !old.files.empty() &&
+        dimension != old.header.dimension)
+        return update_index(dir, options, embed, false);
+
+    std::string strings = options.model;
+    std::vector<file_entry>  entries;
+    std::vector<chunk_entry> chunks;
+    std::vector<const float*> chunk_vectors;
+    size_t                    next_vector = 0;
+    update_stats              stats;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        pending_file& file  = files[i];
+        file_entry    entry = file.entry;
+        if (file.old_file < 0 && file.chunks.empty())
+            continue;
+        entry.path_offset = strings.size();
+        entry.path_size   = names[i].size();
+        entry.first_chunk = chunks.size();
+        strings += names[i];
+        uint32_t file_id = entries.size();
+        if (file.old_file >= 0)
+        {
+            file_entry before = old.file(file.old_file);
+            for (uint32_t c = 0; c < before.chunk_count; c++)
+            {
+                chunk_entry chunk = old.chunk(before.first_chunk + c);
+                chunk.file        = file_id;
+                chunks.push_back(chunk);
+                chunk_vectors.push_back(old.vector(before.first_chunk + c));
+            }
+            stats.reused += before.chunk_count;
+        }
+        else
+        {
+            for (const auto& c : file.chunks)
+            {
+                chunks.push_back({c.offset, c.size, c.first_line, c.line_count,
+                                  file_id});
+                chunk_vectors.push_back(vectors[next_vector++].data());
+            }
+            stats.embedded += file.chunks.size();
+        }
+        entry.chunk_count = chunks.size() - entry.first_chunk;
+        entries.push_back(entry);
+    }
+    stats.files  = entries.size();
+    stats.chunks = chunks.size();
+
+    file_header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.dimension   = dimension;
+    header.file_count  = entries.size();
+    header.chunk_count = chunks.size();
+    header.model_size  = options.model.size();
+    size_t chunks_end  = chunks_offset(header) +
+                        chunks.size() * sizeof(chunk_entry);
+    header.vectors_offset = (chunks_end + VECTOR_ALIGN - 1) / VECTOR_ALIGN *
+                            VECTOR_ALIGN;
+    header.strings_offset =
+        header.vectors_offset + chunks.size() * dimension * sizeof(float);
+    header.strings_size = strings.size();
+
+    // Written aside and renamed, so readers never map a partial index
+    std::string temp_path = index_path + ".tmp";
+    FILE*       out       = fopen(temp_path.c_str(), "wb");
+    if (!out)
+        throw std::runtime_error("Failed to write '" + temp_path +
+                                 "': " + strerror(errno));
+    const char padding[VECTOR_ALIGN] = {};
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(entries.data(), sizeof(file_entry), entries.size(), out);
+    fwrite(chunks.data(), sizeof(chunk_entry), chunks.size(), out);
+    fwrite(padding, 1, header.vectors_offset - chunks_end, out);
+    for (const float* vector : chunk_vectors)
+        fwrite(vector, sizeof(float), dimension, out);
+    fwrite(strings.data(), 1, strings.size(), out);
+    bool written = !ferror(out);
+    if (fclose(out) != 0 || !written ||
+        rename(temp_path.c_str(), index_path.c_str()) != 0)
+    {
+        remove(temp_path.c_str());
+        throw std::runtime_error("Failed to write '" + index_path + "'");
+    }
+    return stats;
+}
+
+embed::update_stats embed::update(const std::string&    dir,
+                                  const update_options& options,
+                                  const embedder&       embed)
+{
+    return update_index(dir, options, embed, true);
+}
+
+// embed::index
+embed::index::index(const std::string& dir)
+    : map_(dir + "/" + INDEX_FILE_NAME)
+{
+    file_header header;
+    if (map_.size() < sizeof(header))
+        throw std::runtime_error("Corrupt vector index in '" + dir + "'");
+    memcpy(&header, map_.data(), sizeof(header));
+    if (!valid(header, map_.size()))
+        throw std::runtime_error("Corrupt vector index in '" + dir + "'");
+
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(map_.data());
+    dimension_          = header.dimension;
+    chunk_count_        = header.chunk_count;
+    files_              = base + sizeof(header);
+    chunks_             = base + chunks_offset(header);
+    vectors_ = reinterpret_cast<const float*>(base + header.vectors_offset);
+    strings_ = base + header.strings_offset;
+}
+
+std::vector<embed::match> embed::index::nearest(
+    const std::vector<float>& query, size_t k) const
+{
+    if (query.size() != dimension_)
+        throw std::runtime_error("Query has " + std::to_string(query.size()) +
+                                 " dimensions, the index " +
+                                 std::to_string(dimension_));
+
+    // A min-heap of the best k so far
+    using scored = std::pair<float, uint32_t>;
+    std::priority_queue<scored, std::vector<scored>, std::greater<scored>> best;
+    for (uint32_t i = 0; i < chunk_count_; i++)
+    {
+        float score = dot(query.data(), vectors_ + (size_t)i * dimension_,
+                          dimension_);
+        if (best.size() < k)
+            best.emplace(score, i);
+        else if (k && score > best.top().first)
+        {
+            best.pop();
+            best.emplace(score, i);
+        }
+    }
+
+    std::vector<match> matches(best.size());
+    for (size_t i = matches.size(); i-- > 0; best.pop())
+    {
+        chunk_entry entry = record<chunk_entry>(chunks_, best.top().second);
+        file_entry  file  = record<file_entry>(files_, entry.file);
+        match&      found = matches[i];
+        found.where.path.assign(reinterpret_cast<const char*>(strings_) +
+                                    file.path_offset,
+                                file.path_size);
+        found.where.offset     = entry.offset;
+        found.where.size       = entry.size;
+        found.where.first_line = entry.first_line;
+        found.where.line_count = entry.line_count;
+        found.score            = best.top().first;
+    }
+    return matches;
+}
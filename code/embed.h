@@ -0,0 +1,87 @@
+#ifndef LJ_EMBED_H
+#define LJ_EMBED_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "io.h"
+
+namespace embed
+{
+const std::string INDEX_FILE_NAME = ".jipitty-vectors";
+constexpr size_t  CHUNK_LINES     = 40;
+constexpr size_t  CHUNK_BYTES     = 4096;  // Lines are split up past this
+constexpr size_t  VECTOR_ALIGN    = 64;
+
+// Texts in, one vector of the same dimension per text out. Called from
+// several threads at once, so it must not share a connection.
+using embedder = std::function<std::vector<std::vector<float>>(
+    const std::vector<std::string>&)>;
+
+struct chunk
+{
+    std::string path; // Relative to the indexed directory
+    uint64_t    offset     = 0;
+    uint32_t    size       = 0;
+    uint32_t    first_line = 0; // Zero based
+    uint32_t    line_count = 0;
+};
+
+struct match
+{
+    chunk where;
+    float score = 0;
+};
+
+struct update_options
+{
+    std::string model;
+    size_t      batch_size    = 64;
+    unsigned    workers       = 4;
+    size_t      max_file_size = 1 << 20;
+};
+
+struct update_stats
+{
+    size_t files    = 0;
+    size_t chunks   = 0;
+    size_t embedded = 0; // Chunks sent to the embedder
+    size_t reused   = 0; // Chunks kept from the previous index
+};
+
+// Splits text into runs of whole lines, CHUNK_LINES at most and rarely much
+// over CHUNK_BYTES.
+std::vector<chunk> split(std::string_view text);
+
+// Brings dir/.jipitty-vectors up to date with the text files under dir.
+// Files whose size and mtime, or failing that content hash, are unchanged
+// keep their vectors; everything else is chunked and embedded in batches.
+update_stats update(const std::string& dir, const update_options& options,
+                    const embedder& embed);
+
+float dot(const float* a, const float* b, size_t size);
+void  normalize(std::vector<float>& vector);
+
+// A read-only view of a mapped vector index.
+class index
+{
+public:
+    explicit index(const std::string& dir);
+
+    // The k chunks whose vectors are closest to query (unit length) by
+    // cosine similarity, best first.
+    std::vector<match> nearest(const std::vector<float>& query,
+                               size_t                    k) const;
+    size_t             dimension() const { return dimension_; }
+    size_t             chunk_count() const { return chunk_count_; }
+
+private:
+    io::mapping    map_;
+    uint32_t       dimension_ = 0, chunk_count_ = 0;
+    const uint8_t *files_ = nullptr, *chunks_ = nullptr, *strings_ = nullptr;
+    const float*   vectors_ = nullptr;
+};
+} // namespace embed
+#endif
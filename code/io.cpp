@@ -0,0 +1,500 @@
+#include "io.h"
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// io::mapping
+io::mapping::mapping(int fd) { map(fd); }
+
+io::mapping::mapping(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open '" + path +
+                                 "': " + strerror(errno));
+    try
+    {
+        map(fd);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+io::mapping::mapping(io::mapping&& other) noexcept
+    : addr_(other.addr_), size_(other.size_)
+{
+    other.addr_ = nullptr;
+    other.size_ = 0;
+}
+
+io::mapping& io::mapping::operator=(io::mapping&& other) noexcept
+{
+    if (this != &other)
+    {
+        unmap();
+        addr_       = other.addr_;
+        size_       = other.size_;
+        other.addr_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+io::mapping::~mapping() { unmap(); }
+
+void io::mapping::map(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw std::runtime_error(std::string("fstat failed: ") +
+                                 strerror(errno));
+    if (!S_ISREG(st.st_mode))
+        throw std::invalid_argument("Not a regular file");
+
+    // Zero-length regular files (including most of procfs) can't be mapped,
+    // callers fall back to read_all for those.
+    if (st.st_size == 0)
+        return;
+
+    void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                      MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+        throw std::runtime_error(std::string("mmap failed: ") +
+                                 strerror(errno));
+    madvise(addr, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+    addr_ = addr;
+    size_ = static_cast<size_t>(st.st_size);
+}
+
+void io::mapping::unmap()
+{
+    if (addr_ != nullptr)
+        munmap(addr_, size_);
+    addr_ = nullptr;
+    size_ = 0;
+}
+
+bool io::is_regular_file(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+std::string io::read_all(int fd)
+{
+    std::string result;
+    if (is_regular_file(fd))
+    {
+        io::mapping map(fd);
+        if (map.is_mapped())
+        {
+            result.assign(map.data(), map.size());
+            return result;
+        }
+    }
+
+    size_t used = 0;
+    result.resize(READ_BLOCK_SIZE);
+    while (true)
+    {
+        if (result.size() - used < READ_BLOCK_SIZE)
+            result.resize(result.size() * 2);
+        ssize_t count = read(fd, &result[used], result.size() - used);
+        if (count > 0)
+        {
+            used += static_cast<size_t>(count);
+        }
+        else if (count == 0)
+        {
+            break;
+        }
+        else if (errno != EINTR)
+        {
+            throw std::runtime_error(std::string("read failed: ") +
+                                     strerror(errno));
+        }
+    }
+    result.resize(used);
+    return result;
+}
+
+// io::line_index
+io::line_index::line_index(std::string_view text)
+{
+    if (text.empty())
+        return;
+    starts_.push_back(0);
+    const char* begin = text.data();
+    const char* end   = begin + text.size();
+    const char* pos   = begin;
+    while (pos < end)
+    {
+        const void* found = memchr(pos, '\n', static_cast<size_t>(end - pos));
+        if (found == nullptr)
+            break;
+        pos = static_cast<const char*>(found) + 1;
+        if (pos < end)
+            starts_.push_back(static_cast<size_t>(pos - begin));
+    }
+}
+
+std::string_view io::line_index::lines(std::string_view text, size_t first,
+                                       size_t last) const
+{
+    if (first > last || last >= starts_.size())
+        throw std::out_of_range("Line range outside of file");
+    size_t start = starts_[first];
+    size_t end   = last + 1 < starts_.size() ? starts_[last + 1] : text.size();
+    // Only the last line's terminator, so blank lines in the range stay
+    if (end > start && text[end - 1] == '\n')
+        end--;
+    if (end > start && text[end - 1] == '\r')
+        end--;
+    return text.substr(start, end - start);
+}
+
+// io::file_cache
+std::shared_ptr<const io::indexed_file>
+io::file_cache::get(const std::string& path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        throw std::runtime_error("Failed to open '" + path +
+                                 "': " + strerror(errno));
+
+    auto found = entries_.find(path);
+    if (found != entries_.end())
+    {
+        lru_list::iterator  it     = found->second;
+        const indexed_file& cached = **it;
+        if (cached.size == static_cast<size_t>(st.st_size) &&
+            cached.mtime.tv_sec == st.st_mtim.tv_sec &&
+            cached.mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            order_.splice(order_.begin(), order_, it);
+            return *it;
+        }
+        bytes_ -= cached.contents.size();
+        order_.erase(it);
+        entries_.erase(found);
+    }
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open '" + path +
+                                 "': " + strerror(errno));
+    auto entry = std::make_shared<indexed_file>();
+    try
+    {
+        // Stat the open file so the cached mtime and size match what is read
+        if (fstat(fd, &st) != 0)
+            throw std::runtime_error("Failed to open '" + path +
+                                     "': " + strerror(errno));
+        entry->contents = read_all(fd);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    entry->path  = path;
+    entry->mtime = st.st_mtim;
+    entry->size  = static_cast<size_t>(st.st_size);
+    entry->index = line_index(entry->text());
+    insert(entry);
+    return entry;
+}
+
+void io::file_cache::insert(std::shared_ptr<const indexed_file> entry)
+{
+    size_t size = entry->contents.size();
+    // Files that grew or shrank while being read are checked again next time
+    if (size > max_bytes_ || size != entry->size)
+        return;
+    while (bytes_ + size > max_bytes_ && !order_.empty())
+    {
+        bytes_ -= order_.back()->contents.size();
+        entries_.erase(order_.back()->path);
+        order_.pop_back();
+    }
+    order_.push_front(entry);
+    entries_[entry->path] = order_.begin();
+    bytes_ += size;
+}
+
+void io::file_cache::clear()
+{
+    entries_.clear();
+    order_.clear();
+    bytes_ = 0;
+}
+
+bool io::looks_binary(std::string_view text)
+{
+    // Same heuristic as git: a NUL byte near the start means binary.
+    constexpr size_t PROBE_SIZE = 8000;
+    return memchr(text.data(), '\0', std::min(text.size(), PROBE_SIZE)) !=
+           nullptr;
+}
+
+static bool has_glob_chars(const std::string& arg)
+{
+    return arg.find_first_of("*?[") != std::string::npos;
+}
+
+static void walk_directory(const std::string&        root,
+                           std::vector<std::string>& found)
+{
+    namespace fs = std::filesystem;
+    std::error_code          ec;
+    std::vector<std::string> files;
+    fs::recursive_directory_iterator it(
+        root, fs::directory_options::skip_permission_denied, ec);
+    for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+    {
+        const std::string name = it->path().filename().string();
+        if (!name.empty() && name[0] == '.')
+        {
+            if (it->is_directory(ec))
+                it.disable_recursion_pending();
+            continue;
+        }
+        if (it->is_regular_file(ec))
+            files.push_back(it->path().string());
+    }
+    std::sort(files.begin(), files.end());
+    found.insert(found.end(), files.begin(), files.end());
+}
+
+std::vector<std::string>
+io::expand_paths(const std::vector<std::string>& args,
+                 std::vector<std::string>&       unmatched,
+                 std::unordered_set<std::string>* named)
+{
+    std::vector<std::string>        found;
+    std::unordered_set<std::string> seen;
+    for (const auto& arg : args)
+    {
+        std::vector<std::string> matches;
+        if (has_glob_chars(arg))
+        {
+            glob_t globbed = {};
+            if (glob(arg.c_str(), GLOB_TILDE | GLOB_BRACE, nullptr, &globbed) ==
+                0)
+            {
+                for (size_t i = 0; i < globbed.gl_pathc; i++)
+                    matches.push_back(globbed.gl_pathv[i]);
+            }
+            globfree(&globbed);
+            // A name like a[1].txt is a file before it is a pattern
+            std::error_code ec;
+            if (matches.empty() && std::filesystem::exists(arg, ec))
+                matches.push_back(arg);
+        }
+        else
+        {
+            matches.push_back(arg);
+        }
+
+        std::vector<std::string> files;
+        for (const auto& match : matches)
+        {
+            std::error_code ec;
+            if (std::filesystem::is_directory(match, ec))
+                walk_directory(match, files);
+            else
+            {
+                if (named && match == arg)
+                    named->insert(match);
+                files.push_back(match);
+            }
+        }
+        if (files.empty())
+            unmatched.push_back(arg);
+        for (auto& file : files)
+        {
+            if (seen.insert(file).second)
+                found.push_back(std::move(file));
+        }
+    }
+    return found;
+}
+
+static size_t size_limit(const io::read_limits& limits,
+                         const std::string&      path)
+{
+    return limits.named && limits.named->count(path) ? SIZE_MAX
+                                                      : limits.max_file_size;
+}
+
+static void read_one(io::file_contents& file, const io::read_limits& limits)
+{
+    size_t max_size = size_limit(limits, file.path);
+    int fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        file.error = strerror(errno);
+        return;
+    }
+    try
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            static_cast<size_t>(st.st_size) > max_size)
+        {
+            file.status = io::read_status::TOO_LARGE;
+        }
+        else
+        {
+            if (S_ISREG(st.st_mode))
+                file.map = io::mapping(fd);
+            if (!file.map.is_mapped())
+                file.owned = io::read_all(fd);
+            if (file.text().size() > max_size)
+                file.status = io::read_status::TOO_LARGE;
+            else if (io::looks_binary(file.text()))
+                file.status = io::read_status::BINARY;
+            else
+                file.status = io::read_status::OK;
+
+            if (file.status != io::read_status::OK)
+            {
+                file.map   = io::mapping();
+                file.owned = std::string();
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        file.status = io::read_status::FAILED;
+        file.error  = e.what();
+    }
+    close(fd);
+}
+
+static size_t file_size_or_zero(const std::string& path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        return static_cast<size_t>(st.st_size);
+    return 0;
+}
+
+void io::read_files(const std::vector<std::string>&            paths,
+                    const io::read_limits&                     limits,
+                    const std::function<void(file_contents&)>& consume)
+{
+    if (paths.empty())
+        return;
+
+    unsigned workers = limits.workers;
+    if (workers == 0)
+        workers = std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+    workers = std::min<unsigned>(workers, paths.size());
+
+    std::vector<file_contents> results(paths.size());
+    std::vector<size_t>        reserved(paths.size(), 0);
+    std::vector<bool>          ready(paths.size(), false);
+    std::atomic<size_t>        next_index{0};
+    std::mutex                 mutex;
+    std::condition_variable    changed;
+    size_t                     in_flight    = 0;
+    size_t                     next_consume = 0;
+    bool                       aborted      = false;
+
+    auto worker = [&]()
+    {
+        while (true)
+        {
+            size_t index = next_index++;
+            if (index >= paths.size())
+                break;
+
+            size_t cost = std::min(file_size_or_zero(paths[index]),
+                                   size_limit(limits, paths[index]));
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                // The file being waited on always proceeds so the budget
+                // can't deadlock the pool.
+                changed.wait(lock,
+                             [&]()
+                             {
+                                 return aborted || index == next_consume ||
+                                        in_flight + cost <=
+                                            limits.max_bytes_in_flight;
+                             });
+                if (aborted)
+                    break;
+                in_flight += cost;
+                reserved[index] = cost;
+            }
+
+            results[index].path = paths[index];
+            read_one(results[index], limits);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ready[index] = true;
+            }
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers);
+    for (unsigned i = 0; i < workers; i++)
+        pool.emplace_back(worker);
+
+    try
+    {
+        for (; next_consume < paths.size();)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return ready[next_consume]; });
+            }
+            consume(results[next_consume]);
+            results[next_consume] = file_contents();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                in_flight -= reserved[next_consume];
+                next_consume++;
+            }
+            changed.notify_all();
+        }
+    }
+    catch (...)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            next_index = paths.size();
+            aborted    = true;
+        }
+        changed.notify_all();
+        for (auto& thread : pool)
+            thread.join();
+        throw;
+    }
+
+    for (auto& thread : pool)
+        thread.join();
+}
@@ -0,0 +1,147 @@
+#ifndef LJ_IO_H
+#define LJ_IO_H
+
+#include <cstddef>
+#include <ctime>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace io
+{
+constexpr size_t READ_BLOCK_SIZE = 1 << 16;
+
+class mapping
+{
+public:
+    mapping() = default;
+    explicit mapping(int fd);
+    explicit mapping(const std::string& path);
+    mapping(const mapping&)            = delete;
+    mapping& operator=(const mapping&) = delete;
+    mapping(mapping&& other) noexcept;
+    mapping& operator=(mapping&& other) noexcept;
+    ~mapping();
+
+    const char*      data() const { return static_cast<const char*>(addr_); }
+    size_t           size() const { return size_; }
+    bool             is_mapped() const { return addr_ != nullptr; }
+    std::string_view view() const { return {data(), size_}; }
+
+private:
+    void map(int fd);
+    void unmap();
+
+    void*  addr_ = nullptr;
+    size_t size_ = 0;
+};
+
+bool        is_regular_file(int fd);
+std::string read_all(int fd);
+
+// Byte offsets of the start of every '\n' terminated line in a text.
+class line_index
+{
+public:
+    line_index() = default;
+    explicit line_index(std::string_view text);
+
+    size_t line_count() const { return starts_.size(); }
+    // Lines [first, last] (zero based, inclusive) without the final newline.
+    std::string_view lines(std::string_view text, size_t first,
+                           size_t last) const;
+
+private:
+    std::vector<size_t> starts_;
+};
+
+// A file's contents and line index, copied into memory so a file truncated
+// while in use can't fault the way a mapping would.
+struct indexed_file
+{
+    std::string      path;
+    std::string      contents;
+    line_index       index;
+    struct timespec  mtime = {};
+    size_t           size  = 0;
+    std::string_view text() const { return contents; }
+};
+
+// Indexed files keyed by path, revalidated against the file's mtime and size
+// on every get. The least recently used are dropped once the cached text
+// exceeds max_bytes; a file larger than that is read but never kept.
+class file_cache
+{
+public:
+    explicit file_cache(size_t max_bytes = 32 << 20) : max_bytes_(max_bytes)
+    {
+    }
+    std::shared_ptr<const indexed_file> get(const std::string& path);
+    void                                clear();
+
+private:
+    using lru_list = std::list<std::shared_ptr<const indexed_file>>;
+
+    void insert(std::shared_ptr<const indexed_file> entry);
+
+    size_t                                               max_bytes_;
+    size_t                                               bytes_ = 0;
+    lru_list                                             order_; // Newest first
+    std::unordered_map<std::string, lru_list::iterator> entries_;
+};
+
+enum class read_status
+{
+    OK,
+    BINARY,
+    TOO_LARGE,
+    FAILED
+};
+
+struct file_contents
+{
+    std::string      path;
+    read_status      status = read_status::FAILED;
+    std::string      error;
+    mapping          map;
+    std::string      owned;
+    std::string_view text() const
+    {
+        return map.is_mapped() ? map.view() : std::string_view(owned);
+    }
+};
+
+struct read_limits
+{
+    size_t   max_file_size       = 1 << 20;
+    size_t   max_bytes_in_flight = 64 << 20;
+    unsigned workers             = 0; // 0 picks from the hardware
+    // Paths named outright, which max_file_size doesn't apply to
+    const std::unordered_set<std::string>* named = nullptr;
+};
+
+bool looks_binary(std::string_view text);
+
+// Expands globs and walks directories (skipping hidden entries) into a sorted
+// list of regular files per argument. Arguments that match nothing are added
+// to unmatched, and those that name a file outright to named when given.
+std::vector<std::string>
+expand_paths(const std::vector<std::string>& args,
+             std::vector<std::string>&       unmatched,
+             std::unordered_set<std::string>* named = nullptr);
+
+// Reads files on a pool of worker threads and hands them to consume on the
+// calling thread in the order they were given. At most max_bytes_in_flight
+// bytes are held between the workers and consume, except for the file that
+// consume is waiting on.
+void read_files(const std::vector<std::string>&      paths,
+                const read_limits&                   limits,
+                const std::function<void(file_contents&)>& consume);
+} // namespace io
+
+#endif
@@ -0,0 +1,189 @@
+#include "ipc.h"
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static sockaddr_un socket_address(const std::string& path)
+{
+    sockaddr_un address = {};
+    address.sun_family  = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Socket path too long: " + path);
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+std::string ipc::default_socket_path()
+{
+    const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && runtime_dir[0])
+        return std::string(runtime_dir) + "/jipitty.sock";
+    return "/tmp/jipitty-" + std::to_string(getuid()) + ".sock";
+}
+
+// ipc::connection
+ipc::connection::connection(ipc::connection&& other) noexcept : fd_(other.fd_)
+{
+    other.fd_ = -1;
+}
+
+ipc::connection& ipc::connection::operator=(ipc::connection&& other) noexcept
+{
+    if (this != &other)
+    {
+        if (fd_ >= 0)
+            close(fd_);
+        fd_       = other.fd_;
+        other.fd_ = -1;
+    }
+    return *this;
+}
+
+ipc::connection::~connection()
+{
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+void ipc::connection::shutdown()
+{
+    if (fd_ >= 0)
+        ::shutdown(fd_, SHUT_RDWR);
+}
+
+ipc::connection ipc::connection::connect(const std::string& path)
+{
+    sockaddr_un address = socket_address(path);
+    connection  conn(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!conn.is_open() ||
+        ::connect(conn.fd_, reinterpret_cast<sockaddr*>(&address),
+                  sizeof(address)) != 0)
+        throw std::runtime_error("Failed to connect to '" + path +
+                                 "': " + strerror(errno));
+    return conn;
+}
+
+bool ipc::connection::write_all(const char* data, size_t size)
+{
+    while (size)
+    {
+        ssize_t written = ::send(fd_, data, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool ipc::connection::read_all(char* data, size_t size)
+{
+    while (size)
+    {
+        ssize_t got = ::read(fd_, data, size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool ipc::connection::send(ipc::frame_type type, std::string_view payload)
+{
+    if (payload.size() > MAX_FRAME_SIZE)
+        return false;
+    char     header[HEADER_SIZE];
+    uint32_t size = payload.size();
+    header[0]     = static_cast<char>(type);
+    for (int i = 0; i < 4; i++)
+        header[1 + i] = static_cast<char>(size >> (24 - 8 * i));
+    return write_all(header, sizeof(header)) &&
+           write_all(payload.data(), payload.size());
+}
+
+bool ipc::connection::receive(ipc::frame& out)
+{
+    unsigned char header[HEADER_SIZE];
+    if (!read_all(reinterpret_cast<char*>(header), sizeof(header)))
+        return false;
+    uint32_t size = 0;
+    for (int i = 0; i < 4; i++)
+        size = (size << 8) | header[1 + i];
+    if (size > MAX_FRAME_SIZE)
+        return false;
+    out.payload.resize(size);
+    if (!read_all(out.payload.data(), size))
+        return false;
+    out.type = static_cast<frame_type>(header[0]);
+    return true;
+}
+
+// ipc::listener
+ipc::listener::listener(const std::string& path) : path_(path)
+{
+    sockaddr_un address = socket_address(path);
+    int  probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live  = probe >= 0 &&
+                ::connect(probe, reinterpret_cast<sockaddr*>(&address),
+                          sizeof(address)) == 0;
+    if (probe >= 0)
+        close(probe);
+    if (live)
+        throw std::runtime_error("Already listening on '" + path + "'");
+    unlink(path.c_str());
+
+    // Only the owner may connect, whatever the umask or directory allow
+    fd_             = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(077);
+    bool   bound =
+        fd_ >= 0 &&
+        bind(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    umask(old_mask);
+    if (!bound || chmod(path.c_str(), 0600) != 0 ||
+        listen(fd_, SOMAXCONN) != 0)
+    {
+        std::string error = strerror(errno);
+        if (fd_ >= 0)
+            close(fd_);
+        throw std::runtime_error("Failed to listen on '" + path +
+                                 "': " + error);
+    }
+}
+
+ipc::listener::~listener()
+{
+    close(fd_);
+    unlink(path_.c_str());
+}
+
+ipc::connection ipc::listener::accept()
+{
+    while (true)
+    {
+        int fd = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0)
+        {
+            // Other users would be spending the owner's key
+            ucred     peer = {};
+            socklen_t size = sizeof(peer);
+            if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &size) == 0 &&
+                peer.uid == geteuid())
+                return connection(fd);
+            close(fd);
+            continue;
+        }
+        if (errno != EINTR && errno != ECONNABORTED)
+            throw std::runtime_error(std::string("Failed to accept: ") +
+                                     strerror(errno));
+    }
+}
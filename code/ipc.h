@@ -0,0 +1,74 @@
+#ifndef LJ_IPC_H
+#define LJ_IPC_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace ipc
+{
+// Frames are a type byte, a 32 bit big endian payload length and the payload.
+constexpr size_t HEADER_SIZE    = 5;
+constexpr size_t MAX_FRAME_SIZE = 256 << 20;
+
+enum class frame_type : uint8_t
+{
+    REQUEST = 'Q', // JSON request from a client
+    DATA    = 'D', // Streamed reply text
+    END     = 'E'  // JSON status closing a reply
+};
+
+struct frame
+{
+    frame_type  type = frame_type::END;
+    std::string payload;
+};
+
+// $XDG_RUNTIME_DIR/jipitty.sock, or a per-user socket in /tmp.
+std::string default_socket_path();
+
+class connection
+{
+public:
+    connection() = default;
+    explicit connection(int fd) : fd_(fd) {}
+    connection(const connection&)            = delete;
+    connection& operator=(const connection&) = delete;
+    connection(connection&& other) noexcept;
+    connection& operator=(connection&& other) noexcept;
+    ~connection();
+
+    static connection connect(const std::string& path);
+
+    bool is_open() const { return fd_ >= 0; }
+    // Ends the connection for both sides, waking a blocked receive.
+    void shutdown();
+    // False once the peer has gone away.
+    bool send(frame_type type, std::string_view payload);
+    bool receive(frame& out);
+
+private:
+    bool write_all(const char* data, size_t size);
+    bool read_all(char* data, size_t size);
+
+    int fd_ = -1;
+};
+
+class listener
+{
+public:
+    // Replaces a stale socket file, but not one something still listens on.
+    // Only the same user can connect.
+    explicit listener(const std::string& path);
+    listener(const listener&)            = delete;
+    listener& operator=(const listener&) = delete;
+    ~listener();
+
+    connection accept();
+
+private:
+    std::string path_;
+    int         fd_ = -1;
+};
+} // namespace ipc
+#endif
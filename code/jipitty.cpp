@@ -1,25 +1,161 @@
 #include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <chrono>
 #include <fstream>
+#include <future>
+#include <iomanip>
+#include <list>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <condition_variable>
 #include <sstream>
 #include <cstdlib>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include "bpe.h"
 #include "cli.h"
+#include "diff.h"
+#include "embed.h"
+#include "io.h"
+#include "ipc.h"
 #include "net.h"
+#include "search.h"
+#include "server.h"
 
 using namespace nlohmann;
 struct message
 {
     std::string user;
     std::string assistant;
+    // Token counts cached by the context window, zero until counted
+    mutable size_t tokens        = 0;
+    mutable size_t elided_tokens = 0;
+};
+
+struct token_usage
+{
+    uint64_t requests          = 0;
+    uint64_t prompt_tokens     = 0;
+    uint64_t cached_tokens     = 0;
+    uint64_t completion_tokens = 0;
+    uint64_t reasoning_tokens  = 0;
+    double   wait_seconds      = 0; // Request start to first token
+    double   stream_seconds    = 0; // First token to last
+    // Body bytes before and after content encoding, each way
+    uint64_t sent_bytes = 0, sent_wire_bytes = 0;
+    uint64_t received_bytes = 0, received_wire_bytes = 0;
+
+    // Reads an API usage object, including the optional token details
+    void read(const nlohmann::json& usage)
+    {
+        auto number = [](const nlohmann::json& j, const char* key) -> uint64_t
+        {
+            return j.is_object() && j.contains(key) && j[key].is_number()
+                       ? j[key].get<uint64_t>()
+                       : 0;
+        };
+        prompt_tokens     = number(usage, "prompt_tokens");
+        completion_tokens = number(usage, "completion_tokens");
+        if (usage.contains("prompt_tokens_details"))
+            cached_tokens =
+                number(usage["prompt_tokens_details"], "cached_tokens");
+        if (usage.contains("completion_tokens_details"))
+            reasoning_tokens =
+                number(usage["completion_tokens_details"], "reasoning_tokens");
+    }
+
+    void read_transfer(const net::response& response)
+    {
+        sent_bytes          = response.request_size;
+        sent_wire_bytes     = response.request_wire_size;
+        received_bytes      = response.body.size();
+        received_wire_bytes = response.body_wire_size;
+    }
+
+    void add(const token_usage& other)
+    {
+        requests += other.requests;
+        sent_bytes += other.sent_bytes;
+        sent_wire_bytes += other.sent_wire_bytes;
+        received_bytes += other.received_bytes;
+        received_wire_bytes += other.received_wire_bytes;
+        prompt_tokens += other.prompt_tokens;
+        cached_tokens += other.cached_tokens;
+        completion_tokens += other.completion_tokens;
+        reasoning_tokens += other.reasoning_tokens;
+        wait_seconds += other.wait_seconds;
+        stream_seconds += other.stream_seconds;
+    }
+
+    double tokens_per_second() const
+    {
+        return stream_seconds > 0 ? completion_tokens / stream_seconds : 0;
+    }
+
+    double cache_hit_rate() const
+    {
+        return prompt_tokens ? (double)cached_tokens / prompt_tokens : 0;
+    }
+
+    nlohmann::json to_json() const
+    {
+        return {{"requests", requests},
+                {"prompt_tokens", prompt_tokens},
+                {"cached_tokens", cached_tokens},
+                {"completion_tokens", completion_tokens},
+                {"reasoning_tokens", reasoning_tokens},
+                {"wait_seconds", wait_seconds},
+                {"stream_seconds", stream_seconds},
+                {"sent_bytes", sent_bytes},
+                {"sent_wire_bytes", sent_wire_bytes},
+                {"received_bytes", received_bytes},
+                {"received_wire_bytes", received_wire_bytes}};
+    }
+
+    std::string to_string() const
+    {
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(1) << prompt_tokens
+            << " prompt (" << cached_tokens << " cached, "
+            << 100 * cache_hit_rate() << "%), " << completion_tokens
+            << " completion (" << reasoning_tokens << " reasoning)";
+        if (requests)
+        {
+            oss << std::setprecision(2) << ", " << wait_seconds / requests
+                << "s to first token, " << std::setprecision(1)
+                << tokens_per_second() << " tokens/s";
+        }
+        if (sent_bytes || received_bytes)
+        {
+            oss << std::setprecision(1) << ", " << sent_bytes / 1024.0
+                << " KiB sent as " << sent_wire_bytes / 1024.0 << ", "
+                << received_bytes / 1024.0 << " KiB received as "
+                << received_wire_bytes / 1024.0;
+        }
+        return oss.str();
+    }
 };
 
 struct message_sse_dechunker : net::sse_dechunker
 {
-    std::string message;
-    bool        unexpected_response = false;
-    bool        done                = false;
+    std::string                           message;
+    bool                                  unexpected_response = false;
+    bool                                  done                = false;
+    bool                                  has_usage           = false;
+    token_usage                           usage;
+    std::chrono::steady_clock::time_point first_token;
 };
 
 namespace defaults
@@ -34,14 +170,51 @@ constexpr float   TOP_P                = 0.0f;
 constexpr int     MAX_TOKENS           = 0;
 const std::string SYSTEM_PROMPT        = "";
 const std::string MODEL                = "gpt-4.1";
+const std::string EMBEDDING_MODEL      = "text-embedding-3-small";
+// Stands in for the new message while the rest of a request is serialized
+const std::string BODY_MARKER          = "\x01jipitty-message\x01";
 const std::string API_KEY_ENV          = "OPENAI_API_KEY";
 const std::string FILE_DELIMITER       = std::string(3, char(96));
 const std::string VERSION              = "0.5";
+const std::string SUMMARY_HEADER =
+    "Summary of the earlier part of this conversation:\n";
+const std::string SUMMARY_PROMPT =
+    "Summarize the conversation below so it can replace it as context for "
+    "the rest of the conversation. Keep decisions, facts, names, code "
+    "identifiers, file names and open questions. Extend the existing "
+    "summary if there is one. Reply with the summary only.";
 const std::string NAME                 = "jipitty";
 const std::string DESCRIPTION =
     "An OpenAI Large Language Model CLI, written in C++";
 const int         TERMINAL_HEIGHT = 24;
 const std::string PAGER           = "less";
+const std::string BRANCH          = "main";
+constexpr size_t  MAX_FILE_SIZE   = 1 << 20;
+constexpr size_t  MAX_READ_AHEAD  = 64 << 20;
+constexpr size_t  PACK_HISTORY    = 500;
+constexpr size_t  PACK_MIN_SLICE  = 64;
+constexpr double  DIFF_MAX_RATIO  = 0.5;
+constexpr size_t  BYTES_PER_TOKEN = 4;
+constexpr size_t  MESSAGE_TOKENS  = 3; // Role and separators per message
+constexpr size_t  REPLY_TOKENS    = 3; // Priming for the assistant reply
+constexpr size_t  RESPONSE_RESERVE = 4096;
+constexpr size_t  KEEP_RECENT      = 2;    // Exchanges never elided
+constexpr long    SUMMARY_TIMEOUT  = 120000; // Milliseconds
+constexpr size_t  ELIDE_MIN_SIZE   = 2048; // Smallest attachment to elide
+constexpr double  WINDOW_SLACK     = 0.75; // Budget share used when trimming
+constexpr size_t  SEARCH_HITS      = 10;
+constexpr size_t  ASK_CHUNKS       = 6;
+constexpr size_t  EMBED_BATCH      = 64;  // Chunks per embeddings request
+constexpr unsigned EMBED_WORKERS   = 4;   // Embeddings requests in flight
+constexpr size_t  DAEMON_SESSIONS  = 64;  // Named sessions the daemon keeps
+constexpr int     SESSION_IDLE     = 3600; // Seconds before one is dropped
+// Longest matching model name prefix wins
+const std::vector<std::pair<std::string, size_t>> CONTEXT_WINDOWS = {
+    {"gpt-3.5-turbo", 16385}, {"gpt-4", 8192},        {"gpt-4-turbo", 128000},
+    {"gpt-4o", 128000},       {"gpt-4.1", 1047576},   {"gpt-5", 400000},
+    {"o1", 200000},           {"o3", 200000},         {"o4-mini", 200000},
+    {"grok-4", 256000},       {"deepseek", 128000},   {"qwen-max", 32768},
+    {"gemini", 1048576},      {"claude", 200000}};
 } // namespace defaults
 
 class chat_config
@@ -53,8 +226,18 @@ public:
           top_p(defaults::TOP_P), presence(defaults::PRESENCE_PENALTY),
           frequency(defaults::FREQUENCY_PENALTY),
           max_tokens(defaults::MAX_TOKENS), system(defaults::SYSTEM_PROMPT),
-          model(defaults::MODEL), pager(defaults::PAGER), show_version(false),
-          extract_code(false), extract_language_ident_filters{}
+          model(defaults::MODEL), pager(defaults::PAGER),
+          max_file_size(defaults::MAX_FILE_SIZE), attach_diffs(true),
+          count_tokens(false), context_limit(0),
+          context_windows(defaults::CONTEXT_WINDOWS), compact_exchanges(0),
+          stream_usage(true), cache_key(true), cache_key_everywhere(false),
+          daemon(false),
+          client_mode(false), rate_limit(0), response_cache(0),
+          serve_shared_key(false), show_version(false),
+          startup_profile(false), export_tree(false),
+          embedding_model(defaults::EMBEDDING_MODEL), compress_requests(0),
+          request_encoding(net::content_encoding::GZIP), extract_code(false),
+          extract_language_ident_filters{}
     {
         char* key_ptr = std::getenv(defaults::API_KEY_ENV.c_str());
         api_key       = key_ptr ? key_ptr : "";
@@ -75,9 +258,82 @@ public:
     std::string              system;
     std::string              model;
     std::string              pager;
+    size_t                   max_file_size;
+    bool                     attach_diffs;
+    std::string              vocab_file;
+    bool                     count_tokens;
+    size_t                   context_limit;
+    std::vector<std::pair<std::string, size_t>> context_windows;
+    size_t                   compact_exchanges;
+    bool                     stream_usage;
+    bool                     cache_key;
+    bool                     cache_key_everywhere;
+    std::vector<net::url>    endpoints;
+    std::vector<std::string> compare_models;
+    bool                     daemon;
+    bool                     client_mode;
+    std::string              socket_path;
+    std::string              session;
+    std::string              serve_address;
+    double                   rate_limit;
+    size_t                   response_cache;
+    bool                     serve_shared_key;
+    std::string              serve_token;
     bool                     show_version;
+    bool                     startup_profile;
+    bool                     export_tree;
+    std::string              index_dir;
+    std::string              search_query;
+    std::string              embedding_model;
+    net::url                 embeddings_url;
+    size_t                   compress_requests;
+    net::content_encoding    request_encoding;
     bool                     extract_code;
     std::vector<std::string> extract_language_ident_filters;
+    std::set<int>            given_options; // Keys seen on the command line
+
+    // Context window of the current model in tokens, 0 when unknown.
+    size_t context_window() const
+    {
+        if (context_limit)
+            return context_limit;
+        size_t window = 0, matched = 0;
+        for (const auto& entry : context_windows)
+        {
+            if (entry.first.size() >= matched &&
+                model.compare(0, entry.first.size(), entry.first) == 0)
+            {
+                window  = entry.second;
+                matched = entry.first.size();
+            }
+        }
+        return window;
+    }
+
+    // Adds or replaces context windows from a JSON object of model name
+    // prefixes to token counts.
+    void import_context_windows(const std::string& file_name)
+    {
+        std::ifstream fs(file_name);
+        if (!fs.is_open())
+            throw std::runtime_error("Failed to open '" + file_name + "'");
+        json table = json::parse(fs);
+        if (!table.is_object())
+            throw std::runtime_error("Expected an object in '" + file_name +
+                                     "'");
+        for (const auto& entry : table.items())
+        {
+            auto existing =
+                std::find_if(context_windows.begin(), context_windows.end(),
+                             [&](const auto& window)
+                             { return window.first == entry.key(); });
+            size_t limit = entry.value().get<size_t>();
+            if (existing != context_windows.end())
+                existing->second = limit;
+            else
+                context_windows.emplace_back(entry.key(), limit);
+        }
+    }
 
     void reset()
     {
@@ -168,12 +424,160 @@ public:
             {"pager", 'P', "COMMAND", 0,
              "The pager command to use for long output (e.g., 'glow -p')", 0},
             {"url", 'u', "URL", 0, "OpenAI API base url", 0},
+            {"max-file-size", -2, "BYTES", 0,
+             "Skip files larger than BYTES found by expanding a directory "
+             "or glob",
+             0},
+            {"full-files", -3, 0, 0,
+             "Always attach full file contents instead of diffs against the "
+             "previously sent version",
+             0},
+            {"vocab", -4, "FILE", 0,
+             "tiktoken vocabulary file (cl100k_base or o200k_base) used to "
+             "count tokens locally, splitting text the way that vocabulary "
+             "does",
+             0},
+            {"count-tokens", -5, 0, 0,
+             "Print the token count of each message that would be sent, "
+             "then exit without sending",
+             0},
+            {"context-limit", -6, "TOKENS", 0,
+             "Context window to fit requests into, overriding the model table",
+             0},
+            {"context-table", -7, "FILE", 0,
+             "JSON object of model name prefixes to context window sizes", 0},
+            {"compact", -8, "COUNT", 0,
+             "While idle, summarize the oldest COUNT exchanges in the "
+             "background and send the summary in their place",
+             0},
+            {"no-stream-usage", -9, 0, 0,
+             "Don't ask for token usage with streamed responses, for servers "
+             "that reject stream_options",
+             0},
+            {"no-cache-key", -10, 0, 0,
+             "Never send a prompt_cache_key, even to api.openai.com", 0},
+            {"cache-key", -30, 0, 0,
+             "Send a prompt_cache_key to every server, not only "
+             "api.openai.com",
+             0},
+            {"endpoint", -11, "URL", 0,
+             "Additional server to spread conversations over; each "
+             "conversation sticks to one so its prompt stays cached",
+             0},
+            {"compare", -12, "MODELS", 0,
+             "Send each message to several comma separated models (or "
+             "model@url) at once and show every answer. Scripts keep the "
+             "first answer and the others as branches",
+             0},
+            {"daemon", -13, 0, 0,
+             "Serve clients over a Unix socket, keeping upstream connections "
+             "and sessions warm between requests",
+             0},
+            {"client", -14, 0, 0,
+             "Send the input to a running daemon and print its reply. The "
+             "request settings given (-m, -s, -t, -p, -f, -n, --top_p) "
+             "override the daemon's for that request",
+             0},
+            {"socket", -15, "PATH", 0,
+             "Unix socket of the daemon, $XDG_RUNTIME_DIR/jipitty.sock by "
+             "default",
+             0},
+            {"session", -16, "NAME", 0,
+             "Continue the named conversation the daemon keeps in memory. "
+             "It keeps the 64 most recent for up to an hour idle",
+             0},
+            {"serve", -17, "[HOST:]PORT", 0,
+             "Proxy /v1/chat/completions on a local address through pooled "
+             "upstream connections, streaming replies straight through. "
+             "Listens on 127.0.0.1 unless HOST is given",
+             0},
+            {"rate-limit", -18, "PER_MINUTE", 0,
+             "Requests per minute the proxy forwards before answering 429", 0},
+            {"response-cache", -19, "COUNT", 0,
+             "Replay the last COUNT distinct proxied replies to identical "
+             "requests instead of forwarding them",
+             0},
+            {"serve-token", -29, "TOKEN", 0,
+             "API key proxy callers send to have the configured one used "
+             "upstream, random and printed at startup when not given",
+             0},
+            {"serve-shared-key", -27, 0, 0,
+             "Let proxy callers that send no Authorization header at all use "
+             "the configured API key",
+             0},
+            {"startup-profile", -20, 0, 0,
+             "Print the time spent in each startup phase to stderr", 0},
+            {"export-tree", -21, 0, 0,
+             "Export every branch of the conversation, not only the active "
+             "one",
+             0},
+            {"index", -22, "DIR", 0,
+             "Index the conversation exports under DIR for :search, only "
+             "rebuilding when they changed. Scripts just build the index",
+             0},
+            {"search", -23, "TERMS", 0,
+             "Print the exchanges in the --index directory containing every "
+             "term and exit",
+             0},
+            {"embedding-model", -24, "MODEL", 0,
+             "Model that embeds files for :embed and :ask", 0},
+            {"embeddings-url", -28, "URL", 0,
+             "Embeddings endpoint, by default the completions URL with "
+             "/chat/completions replaced by /embeddings",
+             0},
+            {"compress-requests", -25, "BYTES", 0,
+             "Compress request bodies of at least BYTES, for servers and "
+             "proxies that accept compressed uploads",
+             0},
+            {"request-encoding", -26, "gzip|deflate", 0,
+             "Encoding of compressed request bodies, gzip by default", 0},
             {"version", 'v', 0, 0, "Show version", 0}};
     };
 
+    // Options --client sends along for the daemon to use on that request
+    inline static const std::set<int> daemon_settings = {'m', 's', 't', 'p',
+                                                         'f', 'n', -1};
+
+    // The request settings given on the command line, for the daemon.
+    json given_settings() const
+    {
+        json settings = json::object();
+        if (given_options.count('m'))
+            settings["model"] = model;
+        if (given_options.count('s'))
+            settings["system"] = system;
+        if (given_options.count('t'))
+            settings["temperature"] = temperature;
+        if (given_options.count(-1))
+            settings["top_p"] = top_p;
+        if (given_options.count('p'))
+            settings["presence"] = presence;
+        if (given_options.count('f'))
+            settings["frequency"] = frequency;
+        if (given_options.count('n'))
+            settings["max_tokens"] = max_tokens;
+        return settings;
+    }
+
+    // Applies settings from given_settings, ignoring anything malformed.
+    void apply_settings(const json& settings)
+    {
+        if (!settings.is_object())
+            return;
+        model       = settings.value("model", model);
+        system      = settings.value("system", system);
+        temperature = settings.value("temperature", temperature);
+        top_p       = settings.value("top_p", top_p);
+        presence    = settings.value("presence", presence);
+        frequency   = settings.value("frequency", frequency);
+        max_tokens  = settings.value("max_tokens", max_tokens);
+    }
+
     static int from_shell_arg(int key, char* arg, struct argp_state* state,
                               chat_config& cfg)
     {
+        if (key < 256 && key != ARGP_KEY_ARG)
+            cfg.given_options.insert(key);
         switch (key)
         {
         case 'a':
@@ -226,12 +630,137 @@ public:
         case -1:
             cfg.top_p = atof(arg);
             break;
+        case -2:
+        {
+            char* end         = nullptr;
+            cfg.max_file_size = strtoull(arg, &end, 10);
+            if (!isdigit((unsigned char)arg[0]) || *end ||
+                cfg.max_file_size == 0 || cfg.max_file_size == ULLONG_MAX)
+                argp_error(state, "Invalid file size '%s'", arg);
+        }
+        break;
+        case -3:
+            cfg.attach_diffs = false;
+            break;
+        case -4:
+            cfg.vocab_file = arg;
+            break;
+        case -5:
+            cfg.count_tokens = true;
+            break;
+        case -6:
+            cfg.context_limit = strtoull(arg, nullptr, 10);
+            break;
+        case -7:
+            try
+            {
+                cfg.import_context_windows(arg);
+            }
+            catch (const std::exception& e)
+            {
+                argp_error(state, "%s", e.what());
+            }
+            break;
+        case -8:
+            cfg.compact_exchanges = strtoull(arg, nullptr, 10);
+            break;
+        case -9:
+            cfg.stream_usage = false;
+            break;
+        case -10:
+            cfg.cache_key = false;
+            break;
+        case -11:
+            cfg.endpoints.emplace_back(arg);
+            break;
+        case -12:
+        {
+            std::istringstream models(arg);
+            std::string        model;
+            while (std::getline(models, model, ','))
+            {
+                if (!model.empty())
+                    cfg.compare_models.push_back(model);
+            }
+        }
+        break;
+        case -13:
+            cfg.daemon = true;
+            break;
+        case -14:
+            cfg.client_mode = true;
+            break;
+        case -15:
+            cfg.socket_path = arg;
+            break;
+        case -16:
+            cfg.session = arg;
+            break;
+        case -17:
+            cfg.serve_address = arg;
+            break;
+        case -18:
+            cfg.rate_limit = atof(arg);
+            break;
+        case -19:
+            cfg.response_cache = strtoull(arg, nullptr, 10);
+            break;
+        case -20:
+            cfg.startup_profile = true;
+            break;
+        case -21:
+            cfg.export_tree = true;
+            break;
+        case -22:
+            cfg.index_dir = arg;
+            break;
+        case -23:
+            cfg.search_query = arg;
+            break;
+        case -24:
+            cfg.embedding_model = arg;
+            break;
+        case -25:
+            cfg.compress_requests = strtoull(arg, nullptr, 10);
+            break;
+        case -26:
+            if (std::string(arg) == "gzip")
+                cfg.request_encoding = net::content_encoding::GZIP;
+            else if (std::string(arg) == "deflate")
+                cfg.request_encoding = net::content_encoding::DEFLATE;
+            else
+                argp_error(state, "Unknown encoding '%s'", arg);
+            break;
+        case -27:
+            cfg.serve_shared_key = true;
+            break;
+        case -28:
+            cfg.embeddings_url = net::url(arg);
+            break;
+        case -29:
+            cfg.serve_token = arg;
+            break;
+        case -30:
+            cfg.cache_key_everywhere = true;
+            break;
         case ARGP_KEY_ARG:
             if (state->arg_num >= 1)
                 argp_usage(state);
             cfg.input_file_name = arg;
             break;
         case ARGP_KEY_END:
+            if (cfg.client_mode)
+            {
+                for (int given : cfg.given_options)
+                {
+                    if (!daemon_settings.count(given) && given != -14 &&
+                        given != -15 && given != -16)
+                        argp_error(state,
+                                   "With --client only the socket, session "
+                                   "and request settings (-m, -s, -t, -p, "
+                                   "-f, -n, --top_p) apply");
+                }
+            }
             break;
         default:
             return ARGP_ERR_UNKNOWN;
@@ -240,14 +769,153 @@ public:
     }
 };
 
+// One exchange in the conversation tree. Branches share the nodes of their
+// common prefix, and a node lives as long as some branch reaches it.
+struct message_node
+{
+    message msg;
+    // Mutable only so the destructor can unlink it
+    mutable std::shared_ptr<const message_node> parent;
+
+    message_node(message m, std::shared_ptr<const message_node> p)
+        : msg(std::move(m)), parent(std::move(p))
+    {
+    }
+
+    // Releases a chain of nodes nothing else holds one at a time, where the
+    // default destructor would recurse once per exchange.
+    ~message_node()
+    {
+        std::shared_ptr<const message_node> next = std::move(parent);
+        while (next && next.use_count() == 1)
+            next = std::move(next->parent);
+    }
+};
+
+// A root to tip path through the tree, used like the vector of messages it
+// replaces. Copying a path copies node pointers, never messages.
+class message_path
+{
+public:
+    using node_ptr = std::shared_ptr<const message_node>;
+
+    class const_iterator
+    {
+    public:
+        explicit const_iterator(std::vector<node_ptr>::const_iterator it)
+            : it_(it)
+        {
+        }
+        const message&  operator*() const { return (*it_)->msg; }
+        const message*  operator->() const { return &(*it_)->msg; }
+        const_iterator& operator++()
+        {
+            ++it_;
+            return *this;
+        }
+        bool operator!=(const const_iterator& other) const
+        {
+            return it_ != other.it_;
+        }
+
+    private:
+        std::vector<node_ptr>::const_iterator it_;
+    };
+
+    size_t          size() const { return nodes_.size(); }
+    bool            empty() const { return nodes_.empty(); }
+    const message&  operator[](size_t i) const { return nodes_[i]->msg; }
+    const message&  front() const { return nodes_.front()->msg; }
+    const message&  back() const { return nodes_.back()->msg; }
+    const node_ptr& node(size_t i) const { return nodes_[i]; }
+    node_ptr        tip() const { return empty() ? nullptr : nodes_.back(); }
+    const_iterator  begin() const { return const_iterator(nodes_.begin()); }
+    const_iterator  end() const { return const_iterator(nodes_.end()); }
+
+    void push_back(message msg)
+    {
+        node_ptr parent = nodes_.empty() ? nullptr : nodes_.back();
+        nodes_.push_back(std::make_shared<const message_node>(
+            std::move(msg), std::move(parent)));
+    }
+
+    // Only ever shortens; dropped nodes survive while another path uses them.
+    void resize(size_t count)
+    {
+        if (count < nodes_.size())
+            nodes_.resize(count);
+    }
+
+    // Number of leading exchanges the two paths share.
+    size_t common_prefix(const message_path& other) const
+    {
+        size_t count = 0;
+        while (count < size() && count < other.size() &&
+               nodes_[count] == other.nodes_[count])
+            count++;
+        return count;
+    }
+
+    // Number of leading exchanges shared with the path of length exchanges
+    // ending at tip.
+    size_t common_prefix(node_ptr tip, size_t length) const
+    {
+        for (; tip; tip = tip->parent, length--)
+        {
+            if (length <= size() && nodes_[length - 1] == tip)
+                break;
+        }
+        return tip ? length : 0;
+    }
+
+    static message_path from_tip(node_ptr tip)
+    {
+        message_path path;
+        for (; tip; tip = tip->parent)
+            path.nodes_.push_back(tip);
+        std::reverse(path.nodes_.begin(), path.nodes_.end());
+        return path;
+    }
+
+private:
+    std::vector<node_ptr> nodes_;
+};
+
+// A branch that isn't active, kept as its last exchange so creating one
+// costs nothing. Its path is only rebuilt when it is checked out.
+struct branch_tip
+{
+    message_path::node_ptr tip;
+    size_t                 length = 0;
+};
+
 class chat_completion
 {
 public:
     chat_completion() {};
-    std::vector<message> messages = {};
-    size_t               import_messages(json j)
+    // The active branch
+    message_path messages = {};
+    std::string  branch   = defaults::BRANCH;
+    // Every other branch by name
+    std::map<std::string, branch_tip> branches;
+    // Stands in for messages[0, summarized) in requests
+    std::string summary;
+    size_t      summarized = 0;
+    // Bumped whenever messages are removed rather than appended
+    uint64_t    generation = 0;
+    // First message of the last trimmed request
+    size_t      window_start = 0;
+    // First message the last built request carried with its attachments
+    size_t      full_start = 0;
+
+    size_t import_messages(json j)
     {
-        messages = {};
+        clear();
+        if (j.is_object() && j["tree"].is_object())
+        {
+            import_tree(j["tree"]);
+            return messages.size();
+        }
         if (j.is_object() && j["messages"].is_array())
         {
             bool    have_user    = false;
@@ -280,67 +948,694 @@ public:
         return messages.size();
     }
 
-    json create_request(chat_config& cfg)
+    // Replaces the body of every large delimited attachment with a note.
+    static std::string elide_attachments(const std::string& text)
     {
-        json request_object      = json::object();
-        request_object["model"]  = cfg.model;
-        request_object["stream"] = true;
+        const std::string& delim = defaults::FILE_DELIMITER;
+        std::string        result;
+        size_t             pos = 0;
+        while (true)
+        {
+            size_t start = text.find(delim, pos);
+            while (start != std::string::npos && start > 0 &&
+                   text[start - 1] != '\n')
+                start = text.find(delim, start + 1);
+            size_t body = start == std::string::npos
+                              ? std::string::npos
+                              : text.find('\n', start + delim.size());
+            size_t end = body == std::string::npos
+                             ? std::string::npos
+                             : text.find("\n" + delim, body);
+            if (end == std::string::npos)
+                break;
+            body++;
+            end++;
+            result.append(text, pos, body - pos);
+            if (end - body >= defaults::ELIDE_MIN_SIZE)
+            {
+                result += "[" +
+                          std::to_string(std::count(text.begin() + body,
+                                                    text.begin() + end, '\n')) +
+                          " lines elided]\n";
+            }
+            else
+            {
+                result.append(text, body, end - body);
+            }
+            result += delim;
+            pos = end + delim.size();
+        }
+        result.append(text, pos, std::string::npos);
+        return result;
+    }
 
-        if (cfg.temperature != defaults::TEMPERATURE)
-            request_object["temperature"] = cfg.temperature;
+    // The request that would be sent: a summary in place of the first
+    // summarized messages, and with a token budget and a history that
+    // doesn't fit only the newest exchanges that fit, all but the KEEP_RECENT
+    // newest with their large attachments elided.
+    json create_request(
+        chat_config& cfg, size_t token_budget = 0,
+        const std::function<size_t(std::string_view)>& count_tokens = nullptr)
+    {
+        json        request_object = create_parameters(cfg);
+        std::string system         = cfg.system;
+        if (summarized)
+        {
+            if (!system.empty())
+                system += "\n\n";
+            system += defaults::SUMMARY_HEADER + summary;
+        }
+        if (!system.empty())
+        {
+            request_object["messages"].push_back(
+                {{"role", "system"}, {"content", system}});
+        }
 
-        if (cfg.top_p != defaults::TOP_P)
-            request_object["top_p"] = cfg.top_p;
+        size_t first = summarized, first_full = summarized;
+        if (token_budget && count_tokens)
+        {
+            size_t system_tokens =
+                system.empty()
+                    ? 0
+                    : count_tokens(system) + defaults::MESSAGE_TOKENS;
+            size_t total = system_tokens;
+            for (size_t i = summarized; i < messages.size(); i++)
+            {
+                const message& msg = messages[i];
+                if (!msg.tokens)
+                    msg.tokens = count_tokens(msg.user) +
+                                 count_tokens(msg.assistant) +
+                                 2 * defaults::MESSAGE_TOKENS;
+                total += msg.tokens;
+            }
 
-        if (cfg.max_tokens != defaults::MAX_TOKENS)
-            request_object["max_tokens"] = cfg.max_tokens;
+            if (total > token_budget)
+            {
+                // Keep starting where the last trimmed request started while
+                // that still fits, so the prefix stays byte-identical for
+                // prompt caching. When it stops fitting, trim with slack so
+                // the new start holds for several turns.
+                auto fitted = fit_window(token_budget, system_tokens,
+                                         count_tokens);
+                if (window_start >= fitted.first &&
+                    window_start < messages.size())
+                {
+                    first      = window_start;
+                    first_full = std::max(fitted.second, window_start);
+                }
+                else
+                {
+                    fitted = fit_window(
+                        (size_t)(token_budget * defaults::WINDOW_SLACK),
+                        system_tokens, count_tokens);
+                    first        = fitted.first;
+                    first_full   = fitted.second;
+                    window_start = first;
+                }
+            }
+        }
 
-        if (cfg.presence != defaults::PRESENCE_PENALTY)
-            request_object["presence_penalty"] = cfg.presence;
+        full_start = first_full;
+        for (size_t i = first; i < messages.size(); i++)
+        {
+            const message& msg = messages[i];
+            request_object["messages"].push_back(
+                {{"role", "user"},
+                 {"content",
+                  i < first_full ? elide_attachments(msg.user) : msg.user}});
+            request_object["messages"].push_back(
+                {{"role", "assistant"}, {"content", msg.assistant}});
+        }
+        return request_object;
+    }
 
-        if (cfg.frequency != defaults::FREQUENCY_PENALTY)
-            request_object["frequency_penalty"] = cfg.frequency;
+    // The oldest message index that fits the budget and the index from which
+    // messages are sent with their attachments. The KEEP_RECENT newest are
+    // sent whole while they fit, older ones with attachments elided.
+    std::pair<size_t, size_t>
+    fit_window(size_t token_budget, size_t used,
+               const std::function<size_t(std::string_view)>& count_tokens)
+    {
+        size_t first = messages.size(), first_full = messages.size();
+        bool   eliding = false;
+        for (size_t i = messages.size(); i-- > summarized;)
+        {
+            const message& msg = messages[i];
+            if (!eliding && messages.size() - i <= defaults::KEEP_RECENT &&
+                used + msg.tokens <= token_budget)
+            {
+                used += msg.tokens;
+                first = first_full = i;
+                continue;
+            }
 
-        request_object["messages"] = json::array();
+            eliding = true;
+            if (!msg.elided_tokens)
+                msg.elided_tokens = count_tokens(elide_attachments(msg.user)) +
+                                    count_tokens(msg.assistant) +
+                                    2 * defaults::MESSAGE_TOKENS;
+            if (used + msg.elided_tokens > token_budget)
+                break;
+            used += msg.elided_tokens;
+            first = i;
+        }
+        return {first, first_full};
+    }
+
+    // Stable per conversation, so the provider can route every turn to the
+    // same prompt cache.
+    std::string cache_key(const chat_config& cfg,
+                          const std::string& next_user) const
+    {
+        const std::string& first_user =
+            messages.empty() ? next_user : messages.front().user;
+        uint64_t hash = 14695981039346656037ull; // FNV-1a
+        for (const std::string* part : {&cfg.system, &first_user})
+        {
+            for (unsigned char c : *part)
+                hash = (hash ^ c) * 1099511628211ull;
+            hash = (hash ^ 0xff) * 1099511628211ull;
+        }
+        std::ostringstream oss;
+        oss << defaults::NAME << '-' << std::hex << std::setw(16)
+            << std::setfill('0') << hash;
+        return oss.str();
+    }
+
+    // Every original message, ignoring summaries and context windows.
+    json export_request(chat_config& cfg, bool with_tree = false) const
+    {
+        json request_object = create_parameters(cfg);
         if (!cfg.system.empty())
         {
             request_object["messages"].push_back(
                 {{"role", "system"}, {"content", cfg.system}});
         }
-
-        for (auto message : messages)
+        for (const auto& msg : messages)
         {
             request_object["messages"].push_back(
-                {{"role", "user"}, {"content", message.user}});
+                {{"role", "user"}, {"content", msg.user}});
             request_object["messages"].push_back(
-                {{"role", "assistant"}, {"content", message.assistant}});
+                {{"role", "assistant"}, {"content", msg.assistant}});
         }
+        if (with_tree)
+            request_object["tree"] = export_tree();
         return request_object;
     }
-};
-struct runtime_command
-{
-    std::string           title;
-    std::string           doc;
-    std::function<bool()> action;
-};
 
-class chat_cli
-{
-public:
-    chat_cli(chat_config& c)
-        : cfg(c), completion(), client(), input(), prompt_builder(),
-          building_prompt(false), prompt(), input_file(), sse(),
-          script_mode(!cfg.input_file_name.empty() || !isatty(STDOUT_FILENO) ||
-                      !isatty(STDIN_FILENO))
+    // Every branch as one list of shared nodes, each branch naming its tip.
+    json export_tree() const
     {
-        commands = {
-            {"exit", "Exit the program.",
-             [&]()
-             {
-                 prompt.keep_alive = false;
-                 return false;
-             }},
+        std::unordered_map<const message_node*, size_t> index;
+        json nodes = json::array(), tips = json::object();
+        auto add   = [&](const message_path& path) -> long
+        {
+            for (size_t i = 0; i < path.size(); i++)
+            {
+                const message_node* node = path.node(i).get();
+                if (index.count(node))
+                    continue;
+                index[node] = nodes.size();
+                nodes.push_back(
+                    {{"parent", i ? (long)index[path.node(i - 1).get()] : -1},
+                     {"user", node->msg.user},
+                     {"assistant", node->msg.assistant}});
+            }
+            return path.empty()
+                       ? -1
+                       : (long)index[path.node(path.size() - 1).get()];
+        };
+        tips[branch] = add(messages);
+        for (const auto& entry : branches)
+            tips[entry.first] = add(message_path::from_tip(entry.second.tip));
+        return {{"active", branch}, {"nodes", nodes}, {"branches", tips}};
+    }
+
+    void import_tree(const json& tree)
+    {
+        json tips = tree.value("branches", json::object());
+        if (!tree.contains("nodes") || !tree.at("nodes").is_array() ||
+            !tips.is_object())
+            throw std::runtime_error("Malformed conversation tree");
+        std::vector<message_path::node_ptr> nodes;
+        std::vector<size_t>                 depths;
+        for (const auto& node : tree.at("nodes"))
+        {
+            if (!node.is_object())
+                throw std::runtime_error("Malformed conversation tree");
+            long parent = node.value("parent", -1L);
+            bool linked = parent >= 0 && (size_t)parent < nodes.size();
+            nodes.push_back(std::make_shared<const message_node>(
+                message{node.value("user", ""), node.value("assistant", "")},
+                linked ? nodes[parent] : nullptr));
+            depths.push_back(linked ? depths[parent] + 1 : 1);
+        }
+        for (const auto& entry : tips.items())
+        {
+            long tip =
+                entry.value().is_number() ? entry.value().get<long>() : -1;
+            if (tip >= 0 && (size_t)tip < nodes.size())
+                branches[entry.key()] = {nodes[tip], depths[tip]};
+            else
+                branches[entry.key()] = {};
+        }
+        std::string active = tree.value("active", defaults::BRANCH);
+        if (branches.count(active))
+        {
+            messages = message_path::from_tip(branches[active].tip);
+            branches.erase(active);
+        }
+        branch = active;
+    }
+
+    // Starts a branch from the first count exchanges of the active one and
+    // makes it active; the old branch keeps its full history.
+    bool create_branch(const std::string& name, size_t count)
+    {
+        if (name.empty() || name == branch || branches.count(name))
+            return false;
+        branches[branch] = {messages.tip(), messages.size()};
+        branch           = name;
+        truncate(count);
+        return true;
+    }
+
+    // Saves the active branch under a fresh name before it is cut short, so
+    // a new reply after :prev no longer discards the old continuation.
+    std::string keep_branch()
+    {
+        std::string name;
+        for (size_t n = 1;
+             name.empty() || name == branch || branches.count(name); n++)
+            name = branch + "." + std::to_string(n);
+        branches[name] = {messages.tip(), messages.size()};
+        return name;
+    }
+
+    bool checkout(const std::string& name)
+    {
+        auto found = branches.find(name);
+        if (found == branches.end())
+            return false;
+        message_path target = message_path::from_tip(found->second.tip);
+        branches.erase(found);
+        if (summarized > target.common_prefix(messages))
+            clear_summary();
+        branches[branch] = {messages.tip(), messages.size()};
+        messages         = std::move(target);
+        branch           = name;
+        window_start     = 0;
+        generation++;
+        return true;
+    }
+
+    // Drops messages from index count on, along with a summary covering them.
+    void truncate(size_t count)
+    {
+        if (count >= messages.size())
+            return;
+        messages.resize(count);
+        if (summarized > count)
+            clear_summary();
+        window_start = 0;
+        generation++;
+    }
+
+    void clear()
+    {
+        messages = {};
+        branches.clear();
+        branch = defaults::BRANCH;
+        clear_summary();
+        window_start = 0;
+        generation++;
+    }
+
+    void clear_summary()
+    {
+        summary.clear();
+        summarized = 0;
+    }
+
+private:
+    static json create_parameters(const chat_config& cfg)
+    {
+        json request_object      = json::object();
+        request_object["model"]  = cfg.model;
+        request_object["stream"] = true;
+
+        if (cfg.temperature != defaults::TEMPERATURE)
+            request_object["temperature"] = cfg.temperature;
+
+        if (cfg.top_p != defaults::TOP_P)
+            request_object["top_p"] = cfg.top_p;
+
+        if (cfg.max_tokens != defaults::MAX_TOKENS)
+            request_object["max_tokens"] = cfg.max_tokens;
+
+        if (cfg.presence != defaults::PRESENCE_PENALTY)
+            request_object["presence_penalty"] = cfg.presence;
+
+        if (cfg.frequency != defaults::FREQUENCY_PENALTY)
+            request_object["frequency_penalty"] = cfg.frequency;
+
+        request_object["messages"] = json::array();
+        return request_object;
+    }
+};
+struct sent_file
+{
+    size_t      hash;
+    size_t      exchange; // Index of the exchange that carried this version
+    std::string text;
+    // That exchange, which another branch may not contain at the same index
+    std::weak_ptr<const message_node> node;
+    // The exchange with the file's full text, which later diffs build on
+    size_t      base = 0;
+    // While pending, the diff or note attached in place of the full text
+    std::string diff;
+};
+
+struct compaction_job
+{
+    std::future<std::string> summary;
+    size_t                   end        = 0;
+    uint64_t                 generation = 0;
+    // Set on destruction, so exit waits at most a second for the request
+    std::shared_ptr<std::atomic<bool>> cancel =
+        std::make_shared<std::atomic<bool>>(false);
+    ~compaction_job() { *cancel = true; }
+};
+
+// One model's answer in a comparison, written by its own request thread.
+struct comparison_entry
+{
+    std::string                           label;
+    std::string                           model;
+    net::url                              url;
+    message_sse_dechunker                 stream;
+    std::string                           unshown; // Streamed but not printed
+    std::string                           error;
+    bool                                  finished = false;
+    std::chrono::steady_clock::time_point start, end;
+    net::response                         response;
+};
+
+struct comparison
+{
+    message_path::node_ptr                         base; // Exchange answered
+    std::string                                    user;
+    std::vector<std::unique_ptr<comparison_entry>> entries;
+    std::unordered_map<std::string, sent_file>     attached;
+};
+
+// A conversation the daemon keeps between client requests.
+struct daemon_session
+{
+    std::mutex                            lock; // Held for a whole exchange
+    chat_completion                       completion;
+    std::chrono::steady_clock::time_point last_used; // Under daemon_mutex
+};
+
+// Token bucket refilled at a steady rate, bursting up to one minute's worth.
+class rate_limiter
+{
+public:
+    explicit rate_limiter(double per_minute = 0)
+        : rate_(per_minute / 60), tokens_(per_minute),
+          last_(std::chrono::steady_clock::now())
+    {
+    }
+
+    // Seconds until a request may pass, 0 when it passed.
+    double acquire()
+    {
+        if (rate_ <= 0)
+            return 0;
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - last_).count();
+        tokens_        = std::min(rate_ * 60, tokens_ + rate_ * elapsed);
+        last_ = now;
+        if (tokens_ >= 1)
+        {
+            tokens_ -= 1;
+            return 0;
+        }
+        return (1 - tokens_) / rate_;
+    }
+
+private:
+    std::mutex                            mutex_;
+    double                                rate_;
+    double                                tokens_;
+    std::chrono::steady_clock::time_point last_;
+};
+
+struct cached_reply
+{
+    std::string       content_type;
+    net::shared_bytes body;
+};
+
+// The credentials and request body, which is shared rather than copied.
+struct reply_key
+{
+    std::string       authorization;
+    net::shared_bytes body;
+
+    bool operator==(const reply_key& other) const
+    {
+        return authorization == other.authorization &&
+               body.view() == other.body.view();
+    }
+};
+
+struct reply_key_hash
+{
+    size_t operator()(const reply_key& key) const
+    {
+        return std::hash<std::string>()(key.authorization) * 31 ^
+               std::hash<std::string_view>()(key.body.view());
+    }
+};
+
+// Least recently used replies, keyed on the credentials and request body.
+class reply_cache
+{
+public:
+    explicit reply_cache(size_t capacity = 0) : capacity_(capacity) {}
+
+    bool get(const reply_key& key, cached_reply& out)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto                        found = index_.find(key);
+        if (found == index_.end())
+            return false;
+        entries_.splice(entries_.begin(), entries_, found->second);
+        out = found->second->second;
+        return true;
+    }
+
+    void put(const reply_key& key, cached_reply reply)
+    {
+        if (!capacity_)
+            return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto                        found = index_.find(key);
+        if (found != index_.end())
+        {
+            entries_.erase(found->second);
+            index_.erase(found);
+        }
+        entries_.emplace_front(key, std::move(reply));
+        index_[key] = entries_.begin();
+        if (entries_.size() > capacity_)
+        {
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
+
+private:
+    using entry_list = std::list<std::pair<reply_key, cached_reply>>;
+    std::mutex mutex_;
+    size_t     capacity_;
+    entry_list entries_;
+    std::unordered_map<reply_key, entry_list::iterator, reply_key_hash> index_;
+};
+
+// Threads serving one connection each. They are joined rather than detached,
+// so none outlives what it serves: stop() shuts the open connections down
+// and waits for every thread.
+template <typename Connection> class connection_threads
+{
+public:
+    ~connection_threads() { stop(); }
+
+    template <typename Serve> void start(Connection conn, Serve serve)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        reap();
+        auto entry    = std::make_shared<slot>();
+        entry->thread = std::thread(
+            [this, entry, serve, conn = std::move(conn)]() mutable
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    entry->conn = stopping_ ? nullptr : &conn;
+                }
+                if (entry->conn)
+                    serve(conn);
+                // Before conn closes, so stop() never touches a reused fd
+                std::lock_guard<std::mutex> lock(mutex_);
+                entry->conn = nullptr;
+                entry->done = true;
+            });
+        slots_.push_back(std::move(entry));
+    }
+
+    void stop()
+    {
+        std::vector<std::shared_ptr<slot>> running;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            for (auto& entry : slots_)
+            {
+                if (entry->conn)
+                    entry->conn->shutdown();
+            }
+            running.swap(slots_);
+        }
+        for (auto& entry : running)
+            entry->thread.join();
+    }
+
+private:
+    struct slot
+    {
+        std::thread thread;
+        Connection* conn = nullptr;
+        bool        done = false;
+    };
+
+    void reap()
+    {
+        for (auto it = slots_.begin(); it != slots_.end();)
+        {
+            if ((*it)->done)
+            {
+                (*it)->thread.join();
+                it = slots_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    std::mutex                         mutex_;
+    std::vector<std::shared_ptr<slot>> slots_;
+    bool                               stopping_ = false;
+};
+
+// Relays an upstream reply to a proxy client as it arrives.
+struct proxied_reply
+{
+    net::server_connection* conn;
+    int                     status = 0;
+    std::string             content_type;
+    bool                    started = false;
+    bool                    failed  = false;
+};
+
+// Time spent in each phase from process start, for --startup-profile.
+class startup_profile
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    explicit startup_profile(clock::time_point start) : last_(start) {}
+
+    bool enabled = false;
+
+    void mark(const std::string& phase)
+    {
+        if (!enabled)
+            return;
+        clock::time_point now = clock::now();
+        phases_.emplace_back(
+            phase,
+            std::chrono::duration<double, std::milli>(now - last_).count());
+        last_ = now;
+    }
+
+    // Prints once, to stderr so piped output stays clean.
+    void print()
+    {
+        if (!enabled || printed_)
+            return;
+        printed_     = true;
+        double total = 0;
+        for (const auto& phase : phases_)
+        {
+            total += phase.second;
+            std::cerr << "[" << cli::set_format("Startup", cli::format::YELLOW)
+                      << "] " << std::fixed << std::setprecision(3)
+                      << std::setw(10) << phase.second << " ms  " << phase.first
+                      << std::endl;
+        }
+        std::cerr << "[" << cli::set_format("Startup", cli::format::YELLOW)
+                  << "] " << std::setw(10) << total << " ms  total"
+                  << std::defaultfloat << std::endl;
+    }
+
+private:
+    clock::time_point                         last_;
+    std::vector<std::pair<std::string, double>> phases_;
+    bool                                      printed_ = false;
+};
+
+struct runtime_command
+{
+    std::string           title;
+    std::string           doc;
+    std::function<bool()> action;
+};
+
+class chat_cli
+{
+public:
+    chat_cli(chat_config& c, startup_profile& p)
+        : cfg(c), profile(p), completion(), client(), input(), prompt_builder(),
+          building_prompt(false), prompt(), input_fd(STDIN_FILENO), sse(),
+          script_mode(!cfg.input_file_name.empty() || !isatty(STDOUT_FILENO) ||
+                      !isatty(STDIN_FILENO) || cfg.daemon ||
+                      !cfg.serve_address.empty()),
+          proxy_limiter(cfg.rate_limit), proxy_cache(cfg.response_cache)
+    {
+        configure_transfer(client);
+        resolve_completion_urls();
+        profile.mark("curl client");
+        // Scripts never read commands, so skip building them
+        if (!script_mode)
+        {
+            init_commands();
+            profile.mark("commands");
+        }
+    }
+
+    void init_commands()
+    {
+        commands = {
+            {"exit", "Exit the program.",
+             [&]()
+             {
+                 prompt.keep_alive = false;
+                 return false;
+             }},
 
             {"prompt",
              "Start buffering a prompt with input and commands, or print the "
@@ -378,9 +1673,10 @@ public:
                  }
              }},
 
-            {"file <file_path1> [<file_path2> ...]",
-             "Upload one or more labeled files to OpenAI or "
-             "append to current prompt.",
+            {"file <path1> [<path2> ...]",
+             "Upload one or more labeled files to OpenAI or append to current "
+             "prompt. Paths may be globs or directories, binary and oversized "
+             "files are skipped.",
              [&]() { return add_files_to_prompt(); }},
 
             {"line <file_path> <number> [[+|-]number]",
@@ -388,31 +1684,24 @@ public:
              "second argument either to the third, or to plus/minus the third.",
              [&]()
              {
-                 std::string              file_name = prompt.get_next_arg();
-                 std::ifstream            fs(file_name);
-                 std::stringstream        file_data_buffer;
-                 std::string              file_data;
-                 std::vector<std::string> lines = {};
-                 if (fs.is_open())
+                 std::string file_name = prompt.get_next_arg();
+                 std::shared_ptr<const io::indexed_file> file;
+                 try
                  {
-                     file_data_buffer
-                         << std::string((std::istreambuf_iterator<char>(fs)),
-                                        std::istreambuf_iterator<char>());
-                     lines = split_lines(file_data_buffer.str());
-                     if (lines.empty())
-                     {
-                         std::cerr
-                             << chat_cli::error_tag_string("Command Error")
-                             << "File '" << file_name << "' was empty"
-                             << std::endl;
-                         return false;
-                     }
+                     file = file_cache.get(file_name);
                  }
-                 else
+                 catch (const std::exception& e)
                  {
                      std::cerr << file_error_tag_string(file_name) << std::endl;
                      return false;
                  }
+                 if (file->index.line_count() == 0)
+                 {
+                     std::cerr << chat_cli::error_tag_string("Command Error")
+                               << "File '" << file_name << "' was empty"
+                               << std::endl;
+                     return false;
+                 }
 
                  int start_line = 0;
                  try
@@ -449,7 +1738,7 @@ public:
                      }
                  }
 
-                 int last_line = lines.size();
+                 int last_line = file->index.line_count();
                  start_line =
                      std::max(0, std::min(start_line - 1, last_line - 1));
                  end_line = std::max(0, std::min(end_line - 1, last_line - 1));
@@ -462,15 +1751,71 @@ public:
                        << start_line + 1;
                  if (end_line > start_line)
                      input << "," << end_line + 1;
-                 input << std::endl;
-                 do
-                 {
-                     input << lines[start_line++] << std::endl;
-                 } while (start_line <= end_line);
+                 input << std::endl
+                       << file->index.lines(file->text(), start_line, end_line)
+                       << std::endl;
                  input << defaults::FILE_DELIMITER << std::endl;
                  return true;
              }},
 
+            {"embed <dir>",
+             "Embed the text files under a directory for :ask, only sending "
+             "files whose content changed since the last time.",
+             [&]()
+             {
+                 std::string dir = prompt.get_next_arg();
+                 if (dir.empty())
+                 {
+                     std::cerr << chat_cli::error_tag_string("Command Error")
+                               << "No directory given" << std::endl;
+                     return false;
+                 }
+                 vector_dir = dir;
+                 update_vectors(false);
+                 return false;
+             }},
+            {"ask [on|off]",
+             "Attach the chunks of the :embed directory closest to each "
+             "message, instead of whole files.",
+             [&]()
+             {
+                 std::string arg = prompt.get_next_arg();
+                 ask_mode        = arg.empty() ? !ask_mode : arg == "on";
+                 if (ask_mode && vector_dir.empty())
+                 {
+                     ask_mode = false;
+                     std::cerr << chat_cli::error_tag_string("Command Error")
+                               << "No index, run :embed <dir> first"
+                               << std::endl;
+                     return false;
+                 }
+                 std::cout << config_tag_string("Ask")
+                           << (ask_mode ? "on, " + vector_dir : "off")
+                           << std::endl;
+                 return false;
+             }},
+            {"pack <dir> <token-budget> [term ...]",
+             "Attach the most relevant files under a directory, honoring "
+             ".gitignore, until the token budget is spent. Files are ranked "
+             "by git recency, matches for the terms (and the buffered "
+             "prompt), and size.",
+             [&]() { return pack_repository(); }},
+
+            {"tokens",
+             "Count the tokens of each message the next request would send, "
+             "including a buffered prompt.",
+             [&]()
+             {
+                 std::string pending =
+                     building_prompt ? prompt_builder.str() : "";
+                 json request_object = create_windowed_request(pending);
+                 if (!pending.empty())
+                     request_object["messages"].push_back(
+                         {{"role", "user"}, {"content", pending}});
+                 print_token_counts(request_object);
+                 return false;
+             }},
+
             {"shell <command>",
              "Execute a shell command and send it with standard output to "
              "OpenAI or "
@@ -502,33 +1847,133 @@ public:
              [&]()
              {
                  prompt_builder.str("");
+                 pending_files.clear();
                  building_prompt = false;
                  return false;
              }},
 
-            {"import <file_path>",
-             "Import a json file to use as the current request object.",
+            {"import <file_path|#hit> [exchange]",
+             "Import a json file to use as the current request object, or a "
+             ":search hit, and move to the given exchange.",
              [&]()
              {
+                 std::string file_name = prompt.get_next_arg();
+                 std::string exchange  = prompt.get_next_arg();
+                 size_t      target    = 0;
+                 if (!file_name.empty() && file_name[0] == '#')
+                 {
+                     size_t hit = strtoull(file_name.c_str() + 1, nullptr, 10);
+                     if (hit == 0 || hit > last_hits.size())
+                     {
+                         std::cerr
+                             << chat_cli::error_tag_string("Command Error")
+                             << "No search hit '" << file_name << "'"
+                             << std::endl;
+                         return false;
+                     }
+                     file_name = last_hits[hit - 1].path;
+                     target    = last_hits[hit - 1].exchange + 1;
+                 }
+                 if (!exchange.empty())
+                     target = strtoull(exchange.c_str(), nullptr, 10);
                  cfg.reset();
-                 import_from_file(prompt.get_next_arg());
+                 import_from_file(file_name);
+                 if (target > 0)
+                 {
+                     response_index =
+                         std::min(target, completion.messages.size());
+                     print_messages();
+                     std::cout << message_tag_string() << std::endl;
+                 }
                  return false;
              }},
-            {"export <file_path>",
-             "Export the current request object to a file.",
+            {"search <terms>",
+             "List the indexed exchanges containing every term, best first.",
              [&]()
              {
-                 export_to_file(prompt.get_next_arg());
+                 std::string query;
+                 size_t      count = prompt.get_arg_count();
+                 for (size_t i = 1; i < count; i++)
+                     query += prompt.get_next_arg() + " ";
+                 if (!archive)
+                 {
+                     std::cerr << chat_cli::error_tag_string("Command Error")
+                               << "No index, start with --index DIR"
+                               << std::endl;
+                     return false;
+                 }
+                 search_archive(query);
                  return false;
              }},
-            {"system <prompt>", "Set the next system prompt.",
+            {"export <file_path> [path|tree]",
+             "Export the current request object to a file, with every branch "
+             "when tree is given.",
              [&]()
              {
-                 std::string system_prompt = prompt.get_next_arg();
-                 if (prompt.get_arg_count() > 1)
-                     cfg.system = system_prompt;
-                 std::cout << config_tag_string("System Prompt") << cfg.system
-                           << std::endl;
+                 std::string file_name = prompt.get_next_arg();
+                 std::string scope     = prompt.get_next_arg();
+                 export_to_file(file_name, scope.empty() ? cfg.export_tree
+                                                         : scope == "tree");
+                 return false;
+             }},
+            {"branch <name>",
+             "Start a new branch from the current exchange and switch to it. "
+             "The branch left behind keeps its later exchanges.",
+             [&]()
+             {
+                 std::string name = prompt.get_next_arg();
+                 if (!completion.create_branch(name, response_index))
+                 {
+                     std::cerr << chat_cli::error_tag_string("Command Error")
+                               << (name.empty() ? "Branch name required"
+                                                : "Branch '" + name +
+                                                      "' already exists")
+                               << std::endl;
+                     return false;
+                 }
+                 std::cout << config_tag_string("Branch") << name << " at "
+                           << response_index << " exchanges" << std::endl;
+                 return false;
+             }},
+            {"checkout <name>", "Switch to another branch of the conversation.",
+             [&]()
+             {
+                 std::string name = prompt.get_next_arg();
+                 if (!completion.checkout(name))
+                 {
+                     std::cerr << chat_cli::error_tag_string("Command Error")
+                               << "No branch '" << name << "'" << std::endl;
+                     return false;
+                 }
+                 response_index = completion.messages.size();
+                 print_messages();
+                 std::cout << config_tag_string("Branch") << name << std::endl;
+                 return false;
+             }},
+            {"branches", "List the branches of the conversation.",
+             [&]()
+             {
+                 std::cout << config_tag_string("* " + completion.branch)
+                           << completion.messages.size() << " exchanges"
+                           << std::endl;
+                 for (const auto& entry : completion.branches)
+                 {
+                     std::cout << config_tag_string("  " + entry.first)
+                               << entry.second.length << " exchanges, "
+                               << completion.messages.common_prefix(
+                                      entry.second.tip, entry.second.length)
+                               << " shared" << std::endl;
+                 }
+                 return false;
+             }},
+            {"system <prompt>", "Set the next system prompt.",
+             [&]()
+             {
+                 std::string system_prompt = prompt.get_next_arg();
+                 if (prompt.get_arg_count() > 1)
+                     cfg.system = system_prompt;
+                 std::cout << config_tag_string("System Prompt") << cfg.system
+                           << std::endl;
                  return false;
              }},
             {"prev [number]",
@@ -565,7 +2010,8 @@ public:
              [&]()
              {
                  cfg.reset();
-                 completion.messages = {};
+                 completion.clear();
+                 sent_files.clear();
                  std::cout << config_tag_string(
                                   "Conversation and parameters reset")
                            << std::endl;
@@ -643,6 +2089,107 @@ public:
                      std::cout << cfg.max_tokens << std::endl;
                  return false;
              }},
+            {"diffs [on|off]",
+             "Attach files that were already sent as a diff against the "
+             "version sent before.",
+             [&]()
+             {
+                 std::string arg = prompt.get_next_arg();
+                 if (arg == "on")
+                     cfg.attach_diffs = true;
+                 else if (arg == "off")
+                     cfg.attach_diffs = false;
+                 std::cout << config_tag_string("Attach Diffs")
+                           << (cfg.attach_diffs ? "on" : "off") << std::endl;
+                 return false;
+             }},
+            {"context [tokens]",
+             "Set the context window to fit requests into, 0 to use the "
+             "model's size from the context table.",
+             [&]()
+             {
+                 std::string arg = prompt.get_next_arg();
+                 if (!arg.empty())
+                     cfg.context_limit = strtoull(arg.c_str(), nullptr, 10);
+                 std::cout << config_tag_string("Context Window");
+                 if (cfg.context_window())
+                     std::cout << cfg.context_window() << " tokens";
+                 else
+                     std::cout << "unlimited";
+                 if (!cfg.context_limit)
+                     std::cout << " (" << cfg.model << ")";
+                 std::cout << std::endl;
+                 return false;
+             }},
+            {"compact [count]",
+             "Summarize the oldest [count] exchanges in the background while "
+             "idle and send the summary in their place, 0 to stop.",
+             [&]()
+             {
+                 std::string arg = prompt.get_next_arg();
+                 if (!arg.empty())
+                     cfg.compact_exchanges = strtoull(arg.c_str(), nullptr, 10);
+                 std::cout << config_tag_string("Compaction");
+                 if (cfg.compact_exchanges)
+                     std::cout << cfg.compact_exchanges
+                               << " exchanges at a time, "
+                               << completion.summarized << " summarized";
+                 else
+                     std::cout << "off";
+                 std::cout << std::endl;
+                 return false;
+             }},
+            {"compare <model[@url]> [...]",
+             "Send the next message to each model at once, streaming every "
+             "answer in its own section. Keep one with :promote.",
+             [&]()
+             {
+                 size_t count = prompt.get_arg_count();
+                 compare_next.clear();
+                 for (size_t i = 1; i < count; i++)
+                     compare_next.push_back(prompt.get_next_arg());
+                 if (compare_next.empty())
+                 {
+                     std::cerr << chat_cli::error_tag_string("Command Error")
+                               << "No models given" << std::endl;
+                     return false;
+                 }
+                 std::cout << config_tag_string("Compare")
+                           << "The next message goes to "
+                           << compare_next.size() << " models" << std::endl;
+                 return false;
+             }},
+            {"promote <number|model>",
+             "Add an answer from the last comparison to the conversation.",
+             [&]()
+             {
+                 promote_comparison(prompt.get_next_arg());
+                 return false;
+             }},
+            {"stats",
+             "Show token usage, prompt cache hits and throughput for the last "
+             "turn, the session and each model.",
+             [&]()
+             {
+                 if (!session_usage.requests)
+                 {
+                     std::cout << config_tag_string("Usage")
+                               << "No requests yet" << std::endl;
+                     return false;
+                 }
+                 std::cout << config_tag_string("Last Turn")
+                           << turn_usage.to_string() << std::endl;
+                 std::cout << config_tag_string("Session")
+                           << session_usage.requests << " requests, "
+                           << session_usage.to_string() << std::endl;
+                 for (const auto& entry : model_usage)
+                 {
+                     std::cout << config_tag_string(entry.first)
+                               << entry.second.requests << " requests, "
+                               << entry.second.to_string() << std::endl;
+                 }
+                 return false;
+             }},
             {"model <name>", "Set the name of the language model to use.",
              [&]()
              {
@@ -668,7 +2215,10 @@ public:
              {
                  std::string url = prompt.get_next_arg();
                  if (!url.empty())
+                 {
                      cfg.base_url = net::url(url);
+                     resolve_completion_urls();
+                 }
                  std::cout << config_tag_string("API Base URL")
                            << cfg.base_url.to_string() << std::endl;
                  return false;
@@ -828,17 +2378,43 @@ public:
     }
 
     chat_config                  cfg;
+    startup_profile&             profile;
     chat_completion              completion;
     net::client                  client;
     std::ostringstream           input;
     std::ostringstream           prompt_builder;
     bool                         building_prompt;
     cli::prompt                  prompt;
-    std::ifstream                input_file;
+    int                          input_fd;
+    io::file_cache               file_cache;
+    std::unordered_map<std::string, sent_file> sent_files;
+    std::unordered_map<std::string, sent_file> pending_files;
+    bpe::encoder                               tokenizer;
     message_sse_dechunker        sse;
     bool                         script_mode;
     size_t                       response_index = 0;
     std::vector<runtime_command> commands;
+    compaction_job               compaction;
+    token_usage                  turn_usage;
+    token_usage                  session_usage;
+    std::map<std::string, token_usage> model_usage;
+    std::vector<std::string>           compare_next;
+    comparison                         last_comparison;
+    std::unique_ptr<search::index>     archive;
+    std::vector<search::hit>           last_hits;
+    std::string                        vector_dir;
+    bool                               ask_mode = false;
+    // The base url, then each endpoint, with the completions path filled in
+    std::vector<net::url>              completion_urls;
+    std::mutex                         tokenizer_mutex;
+    std::mutex                         daemon_mutex;
+    std::map<std::string, std::shared_ptr<daemon_session>> daemon_sessions;
+    std::vector<std::unique_ptr<net::client>>              idle_clients;
+    rate_limiter                                           proxy_limiter;
+    reply_cache                                            proxy_cache;
+    // Last, so their threads are joined before anything they use is destroyed
+    connection_threads<ipc::connection>                    daemon_connections;
+    connection_threads<net::server_connection>             http_connections;
 
     static std::string user_tag_string()
     {
@@ -908,50 +2484,1103 @@ public:
         {
             for (auto it = blocks.rbegin(); it != blocks.rend(); it++)
             {
-                for (const auto& f : filters)
-                {
-                    if (net::trim_whitespace(it->first) ==
-                        net::trim_whitespace(f))
-                    {
-                        return net::trim_whitespace(it->second);
-                    }
-                }
+                for (const auto& f : filters)
+                {
+                    if (net::trim_whitespace(it->first) ==
+                        net::trim_whitespace(f))
+                    {
+                        return net::trim_whitespace(it->second);
+                    }
+                }
+            }
+        }
+        return "";
+    }
+
+    bool add_files_to_prompt()
+    {
+        bool send       = false;
+        int  file_count = std::max<int>((int)prompt.get_arg_count() - 1, 0);
+        input.str("");
+        input << std::endl;
+        if (file_count == 0)
+        {
+            std::cerr << chat_cli::error_tag_string("Command Error")
+                      << "No files given" << std::endl;
+        }
+
+        std::vector<std::string> args;
+        for (int file_index = 0; file_index < file_count; file_index++)
+            args.push_back(prompt.get_next_arg());
+
+        // The size limit only guards directory and glob expansion
+        std::vector<std::string>        unmatched;
+        std::unordered_set<std::string> named;
+        std::vector<std::string> paths = io::expand_paths(args, unmatched,
+                                                          &named);
+        for (const auto& file_name : unmatched)
+            std::cerr << file_error_tag_string(file_name) << std::endl;
+
+        io::read_limits limits;
+        limits.max_file_size       = cfg.max_file_size;
+        limits.max_bytes_in_flight = defaults::MAX_READ_AHEAD;
+        limits.named               = &named;
+
+        size_t attached = 0, skipped = 0;
+        io::read_files(
+            paths, limits,
+            [&](io::file_contents& file)
+            {
+                switch (file.status)
+                {
+                case io::read_status::OK:
+                    attach_file(file.path, file.text());
+                    attached++;
+                    send = true;
+                    break;
+                case io::read_status::BINARY:
+                    std::cerr << chat_cli::error_tag_string("File Skipped")
+                              << file.path << " (binary)" << std::endl;
+                    skipped++;
+                    break;
+                case io::read_status::TOO_LARGE:
+                    std::cerr << chat_cli::error_tag_string("File Skipped")
+                              << file.path << " (larger than "
+                              << cfg.max_file_size << " bytes)" << std::endl;
+                    skipped++;
+                    break;
+                case io::read_status::FAILED:
+                    std::cerr << file_error_tag_string(file.path) << std::endl;
+                    skipped++;
+                    break;
+                }
+            });
+
+        if (paths.size() > 1)
+        {
+            std::cout << config_tag_string("Files") << "Attached " << attached;
+            if (skipped)
+                std::cout << ", skipped " << skipped;
+            std::cout << std::endl;
+        }
+        return send;
+    }
+
+    bool load_tokenizer()
+    {
+        if (tokenizer.empty() && !cfg.vocab_file.empty())
+        {
+            try
+            {
+                tokenizer = bpe::encoder(cfg.vocab_file);
+                // Cached estimates are stale once exact counts are available
+                for (const auto& msg : completion.messages)
+                    msg.tokens = msg.elided_tokens = 0;
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << chat_cli::error_tag_string("Vocabulary Error")
+                          << e.what() << std::endl;
+                cfg.vocab_file.clear();
+            }
+        }
+        return !tokenizer.empty();
+    }
+
+    // Exact when a vocabulary is loaded, otherwise a bytes per token guess.
+    size_t count_tokens(std::string_view text)
+    {
+        if (load_tokenizer())
+        {
+            std::lock_guard<std::mutex> lock(tokenizer_mutex);
+            return tokenizer.count(text);
+        }
+        return (text.size() + defaults::BYTES_PER_TOKEN - 1) /
+               defaults::BYTES_PER_TOKEN;
+    }
+
+    // The request for sending next_user, without it, fitted into the model's
+    // context window minus room for the reply.
+    json create_windowed_request(std::string_view next_user)
+    {
+        return create_windowed_request(completion, next_user);
+    }
+
+    json create_windowed_request(chat_completion& conversation,
+                                 std::string_view next_user)
+    {
+        return create_windowed_request(conversation, next_user, cfg);
+    }
+
+    json create_windowed_request(chat_completion& conversation,
+                                 std::string_view next_user,
+                                 chat_config&     settings)
+    {
+        size_t window = settings.context_window();
+        if (!window)
+            return conversation.create_request(settings);
+
+        size_t reserve = settings.max_tokens > 0
+                             ? (size_t)settings.max_tokens
+                             : std::min(defaults::RESPONSE_RESERVE, window / 4);
+        size_t next = count_tokens(next_user) + defaults::MESSAGE_TOKENS +
+                      defaults::REPLY_TOKENS;
+        size_t budget = window > reserve + next ? window - reserve - next : 1;
+
+        json request_object = conversation.create_request(
+            settings, budget,
+            [&](std::string_view text) { return count_tokens(text); });
+
+        size_t sent    = request_object["messages"].size() / 2;
+        size_t history = conversation.messages.size() - conversation.summarized;
+        if (sent < history && !script_mode)
+        {
+            std::cout << config_tag_string("Context") << "Sending " << sent
+                      << " of " << history << " exchanges to fit " << window
+                      << " tokens" << std::endl;
+        }
+        return request_object;
+    }
+
+    // With several endpoints, a conversation sticks to the one its cache key
+    // hashes to, so its prompt prefix stays cached on that server.
+    const net::url& completions_url(const std::string& cache_key = {}) const
+    {
+        size_t pick = 0;
+        if (completion_urls.size() > 1 && !cache_key.empty())
+            pick = std::hash<std::string>{}(cache_key) % completion_urls.size();
+        return completion_urls[pick];
+    }
+
+    // prompt_cache_key is an OpenAI extension other servers may reject, so it
+    // only goes to api.openai.com unless --cache-key asks for it everywhere.
+    bool sends_cache_key(const net::url& target) const
+    {
+        return cfg.cache_key && (cfg.cache_key_everywhere ||
+                                 target.get_domain() == "api.openai.com");
+    }
+
+    // Fills in the completions path once, rather than for every request.
+    void resolve_completion_urls()
+    {
+        completion_urls = {with_completions_path(cfg.base_url)};
+        for (const auto& endpoint : cfg.endpoints)
+            completion_urls.push_back(with_completions_path(endpoint));
+    }
+
+    static net::url with_completions_path(net::url req_url)
+    {
+        if (req_url.get_path().empty() || req_url.get_path() == "/")
+            req_url.set_path(defaults::COMPLETIONS_ENDPOINT);
+        return req_url;
+    }
+
+    // Starts summarizing the oldest unsummarized exchanges on another thread,
+    // leaving the KEEP_RECENT newest alone.
+    void start_compaction()
+    {
+        size_t start = completion.summarized;
+        size_t end   = start + cfg.compact_exchanges;
+        if (!cfg.compact_exchanges || compaction.summary.valid() ||
+            end + defaults::KEEP_RECENT > response_index)
+            return;
+
+        std::string transcript;
+        if (!completion.summary.empty())
+            transcript += "Existing summary:\n" + completion.summary + "\n\n";
+        for (size_t i = start; i < end; i++)
+        {
+            transcript += "User: " + completion.messages[i].user + "\n\n";
+            transcript +=
+                "Assistant: " + completion.messages[i].assistant + "\n\n";
+        }
+        json body = {
+            {"model", cfg.model},
+            {"messages",
+             {{{"role", "system"}, {"content", defaults::SUMMARY_PROMPT}},
+              {{"role", "user"}, {"content", std::move(transcript)}}}}};
+
+        compaction.end        = end;
+        compaction.generation = completion.generation;
+        compaction.summary    = std::async(
+            std::launch::async,
+            [this, body = std::move(body), url = completions_url(),
+             key = cfg.api_key, cancel = compaction.cancel]() -> std::string
+            {
+                try
+                {
+                    net::client client;
+                    configure_transfer(client);
+                    client.timeout_ms = defaults::SUMMARY_TIMEOUT;
+                    client.cancel     = cancel.get();
+                    client.set_default_header("Authorization", "Bearer " + key);
+                    net::request  req = {url, net::http_method::POST, {}, body};
+                    net::response response = client.send(req);
+                    if (response.curl_code != CURLE_OK ||
+                        response.response_code != 200)
+                        return "";
+                    json reply = json::parse(response.to_string());
+                    return reply["choices"][0]["message"]["content"]
+                        .get<std::string>();
+                }
+                catch (const std::exception& e)
+                {
+                    return "";
+                }
+            });
+    }
+
+    // Applies a finished summary, never waiting on one still in flight.
+    void finish_compaction()
+    {
+        if (!compaction.summary.valid() ||
+            compaction.summary.wait_for(std::chrono::seconds(0)) !=
+                std::future_status::ready)
+            return;
+        std::string summary = compaction.summary.get();
+        if (!summary.empty() &&
+            compaction.generation == completion.generation &&
+            compaction.end <= completion.messages.size())
+        {
+            completion.summary    = std::move(summary);
+            completion.summarized = compaction.end;
+        }
+    }
+
+    // Cuts the active branch back to the exchange on screen before a new one
+    // is added, keeping the exchanges after it as a branch of their own.
+    void truncate_to_cursor()
+    {
+        if (response_index >= completion.messages.size())
+            return;
+        std::string kept = completion.keep_branch();
+        completion.truncate(response_index);
+        if (!script_mode)
+            std::cout << config_tag_string("Branch") << "Later exchanges kept "
+                      << "as '" << kept << "'" << std::endl;
+    }
+
+    // Reads one streamed chunk into the stream's usage and returns its
+    // content delta, empty when it carries none.
+    static std::string read_stream_chunk(message_sse_dechunker& stream,
+                                         const std::string&     data)
+    {
+        try
+        {
+            json chunk = json::parse(data);
+            if (chunk["usage"].is_object())
+            {
+                stream.usage.read(chunk["usage"]);
+                stream.has_usage = true;
+            }
+            json content = chunk["choices"][0]["delta"]["content"];
+            if (content.is_string())
+            {
+                if (stream.message.empty())
+                    stream.first_token = std::chrono::steady_clock::now();
+                return content.get<std::string>();
+            }
+        }
+        catch (const std::exception& e)
+        {
+            if (data.find("[DONE]") != std::string::npos)
+                stream.done = true;
+        }
+        return "";
+    }
+
+    net::url embeddings_url() const
+    {
+        if (!cfg.embeddings_url.to_string().empty())
+            return cfg.embeddings_url;
+        const std::string suffix  = "/chat/completions";
+        net::url          req_url = completions_url();
+        std::string       path    = req_url.get_path();
+        if (path.size() < suffix.size() ||
+            path.compare(path.size() - suffix.size(), suffix.size(),
+                         suffix) != 0)
+            throw std::runtime_error("No embeddings endpoint for '" +
+                                     req_url.to_string() +
+                                     "', set one with --embeddings-url");
+        path.replace(path.size() - suffix.size(), suffix.size(),
+                     "/embeddings");
+        req_url.set_path(std::move(path));
+        return req_url;
+    }
+
+    // One vector per text, in order, or throws with the server's complaint.
+    std::vector<std::vector<float>>
+    request_embeddings(net::client&                    with,
+                       const std::vector<std::string>& texts) const
+    {
+        json body = {{"model", cfg.embedding_model}, {"input", texts}};
+        net::request  req = {embeddings_url(), net::http_method::POST, {},
+                             body};
+        net::response response = with.send(req);
+        if (response.curl_code != CURLE_OK || response.response_code != 200)
+            throw std::runtime_error(response_error(response));
+        json reply = json::parse(response.to_string(), nullptr, false);
+        if (!reply.is_object() || !reply["data"].is_array())
+            throw std::runtime_error("Unexpected server response");
+        std::vector<std::vector<float>> vectors(texts.size());
+        for (const auto& item : reply["data"])
+        {
+            size_t at = item["index"].is_number_unsigned()
+                            ? item["index"].get<size_t>()
+                            : texts.size();
+            if (at >= texts.size() || !item["embedding"].is_array())
+                throw std::runtime_error("Unexpected server response");
+            vectors[at] = item["embedding"].get<std::vector<float>>();
+        }
+        return vectors;
+    }
+
+    // Brings the vectors of the :embed directory up to date, embedding
+    // changed files in concurrent batches.
+    bool update_vectors(bool quiet)
+    {
+        embed::update_options options;
+        options.model         = cfg.embedding_model;
+        options.batch_size    = defaults::EMBED_BATCH;
+        options.workers       = defaults::EMBED_WORKERS;
+        options.max_file_size = cfg.max_file_size;
+        try
+        {
+            embed::update_stats stats = embed::update(
+                vector_dir, options,
+                [&](const std::vector<std::string>& texts)
+                {
+                    // Each worker keeps its own connection between batches
+                    thread_local net::client worker;
+                    configure_transfer(worker);
+                    worker.set_default_header("Authorization",
+                                             "Bearer " + cfg.api_key);
+                    return request_embeddings(worker, texts);
+                });
+            if (!quiet || stats.embedded)
+                std::cout << config_tag_string("Vectors") << stats.files
+                          << " files, " << stats.chunks << " chunks, "
+                          << stats.embedded << " embedded" << std::endl;
+            return true;
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << chat_cli::error_tag_string("Index Error") << e.what()
+                      << std::endl;
+            return false;
+        }
+    }
+
+    // The chunks closest to the question, delimited like :file attachments.
+    std::string retrieve_chunks(const std::string& question)
+    {
+        if (!update_vectors(true))
+            return "";
+        std::ostringstream attached;
+        try
+        {
+            embed::index              vectors(vector_dir);
+            std::vector<float> query =
+                std::move(request_embeddings(client, {question}).front());
+            embed::normalize(query);
+            std::vector<embed::match> matches =
+                vectors.nearest(query, defaults::ASK_CHUNKS);
+            attached << std::endl;
+            for (const auto& found : matches)
+            {
+                const embed::chunk& where = found.where;
+                std::string         path  = vector_dir.back() == '/'
+                                                ? vector_dir + where.path
+                                                : vector_dir + "/" + where.path;
+                std::ifstream       fs(path, std::ios::binary);
+                std::string         text(where.size, '\0');
+                fs.seekg(where.offset);
+                if (!fs.read(&text[0], text.size()))
+                    continue;
+                attached << defaults::FILE_DELIMITER << path << ":"
+                         << where.first_line + 1;
+                if (where.line_count > 1)
+                    attached << "," << where.first_line + where.line_count;
+                attached << std::endl << text;
+                if (text.back() != '\n')
+                    attached << std::endl;
+                attached << defaults::FILE_DELIMITER << std::endl;
+            }
+            std::cout << config_tag_string("Ask") << matches.size()
+                      << " chunks attached" << std::endl;
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << chat_cli::error_tag_string("Index Error") << e.what()
+                      << std::endl;
+            return "";
+        }
+        return attached.str();
+    }
+
+    // The body of a chat request whose last message, usually the one carrying
+    // attachments, is escaped from request_object while uploading instead of
+    // being copied into the serialized request. request_object must outlive
+    // the send.
+    static std::vector<net::body_piece> message_body(json& request_object)
+    {
+        std::string& content = request_object["messages"]
+                                   .back()["content"]
+                                   .get_ref<std::string&>();
+        std::string text = defaults::BODY_MARKER;
+        text.swap(content);
+        std::string dump = request_object.dump();
+        text.swap(content);
+
+        std::string marker = json(defaults::BODY_MARKER).dump();
+        size_t      at     = dump.rfind(marker);
+        std::string tail   = dump.substr(at + marker.size() - 1);
+        dump.resize(at + 1);
+        std::vector<net::body_piece> pieces;
+        pieces.push_back(net::body_piece::literal(std::move(dump)));
+        pieces.push_back(net::body_piece::escaped(content));
+        pieces.push_back(net::body_piece::literal(std::move(tail)));
+        return pieces;
+    }
+
+    // Compression settings every upstream client shares.
+    void configure_transfer(net::client& with) const
+    {
+        with.compress_threshold = cfg.compress_requests;
+        with.request_encoding   = cfg.request_encoding;
+    }
+
+    static std::string response_error(const net::response& response)
+    {
+        if (response.curl_code != CURLE_OK)
+            return curl_easy_strerror(response.curl_code);
+        try
+        {
+            return json::parse(response.to_string())["error"]["message"]
+                .get<std::string>();
+        }
+        catch (const std::exception& e)
+        {
+            return response.status_line;
+        }
+    }
+
+    // Sends the request to every target on its own thread and client. The
+    // answers print one section at a time in target order; later sections
+    // buffer until the ones before them finish.
+    void compare(const std::vector<std::string>& targets, json& request_object)
+    {
+        using seconds = std::chrono::duration<double>;
+        comparison result;
+        result.base = cursor_node();
+        result.user = request_object["messages"].back()["content"];
+        result.attached.swap(pending_files);
+        request_object["stream"] = true;
+        if (cfg.stream_usage)
+            request_object["stream_options"] = {{"include_usage", true}};
+        for (const auto& target : targets)
+        {
+            auto   entry = std::make_unique<comparison_entry>();
+            size_t at    = target.find('@');
+            entry->label = target;
+            entry->model = target.substr(0, at);
+            entry->url   = at == std::string::npos
+                               ? completions_url()
+                               : with_completions_path(
+                                   net::url(target.substr(at + 1)));
+            result.entries.push_back(std::move(entry));
+        }
+
+        std::mutex              mutex;
+        std::condition_variable updated;
+        std::vector<std::thread> threads;
+        for (auto& owned : result.entries)
+        {
+            comparison_entry* entry = owned.get();
+            json              body  = request_object;
+            body["model"]           = entry->model;
+            if (!sends_cache_key(entry->url))
+                body.erase("prompt_cache_key");
+            threads.emplace_back(
+                [&, entry, body = std::move(body)]()
+                {
+                    entry->stream.callback =
+                        [&, entry](const std::string&, const std::string& data)
+                    {
+                        if (data.empty())
+                            return;
+                        std::string delta =
+                            read_stream_chunk(entry->stream, data);
+                        if (delta.empty())
+                            return;
+                        entry->stream.started = true;
+                        entry->stream.message.append(delta);
+                        std::lock_guard<std::mutex> lock(mutex);
+                        entry->unshown.append(delta);
+                        updated.notify_one();
+                    };
+                    net::client client;
+                    configure_transfer(client);
+                    client.set_default_header("Authorization",
+                                             "Bearer " + cfg.api_key);
+                    net::request req = {entry->url, net::http_method::POST, {},
+                                        body};
+                    req.subscribe(net::sse_dechunker_callback, &entry->stream);
+                    entry->start           = std::chrono::steady_clock::now();
+                    net::response response = client.send(req);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    entry->end = std::chrono::steady_clock::now();
+                    if (response.curl_code != CURLE_OK ||
+                        response.response_code != 200)
+                        entry->error = response_error(response);
+                    else if (entry->stream.unexpected_response)
+                        entry->error = "Unexpected server response";
+                    entry->response = std::move(response);
+                    entry->finished = true;
+                    updated.notify_one();
+                });
+        }
+
+        for (size_t i = 0; i < result.entries.size(); i++)
+        {
+            comparison_entry& entry = *result.entries[i];
+            std::cout << "[" << cli::set_format(std::to_string(i + 1) + " " +
+                                                    entry.label,
+                                                cli::format::CYAN)
+                      << "] " << std::flush;
+            std::unique_lock<std::mutex> lock(mutex);
+            bool                         finished = false;
+            while (!finished)
+            {
+                updated.wait(
+                    lock, [&]()
+                    { return !entry.unshown.empty() || entry.finished; });
+                std::string text;
+                text.swap(entry.unshown);
+                finished = entry.finished;
+                lock.unlock();
+                std::cout << text << std::flush;
+                lock.lock();
+            }
+            std::cout << std::endl;
+            if (!entry.error.empty())
+                std::cerr << chat_cli::error_tag_string("API Error")
+                          << entry.error << std::endl;
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        bool answered = false;
+        for (size_t i = 0; i < result.entries.size(); i++)
+        {
+            comparison_entry& entry = *result.entries[i];
+            if (!entry.error.empty())
+                continue;
+            answered = true;
+            record_usage(entry.model, entry.stream, entry.response,
+                         entry.start, entry.end);
+            uint64_t tokens = turn_usage.completion_tokens
+                                  ? turn_usage.completion_tokens
+                                  : count_tokens(entry.stream.message);
+            double total     = seconds(entry.end - entry.start).count();
+            double streaming = turn_usage.stream_seconds;
+            std::cout << config_tag_string(std::to_string(i + 1) + " " +
+                                           entry.label)
+                      << std::fixed << std::setprecision(2)
+                      << turn_usage.wait_seconds << "s to first token, "
+                      << total << "s total, " << std::setprecision(1)
+                      << (streaming > 0 ? tokens / streaming : 0)
+                      << " tokens/s" << std::defaultfloat << std::endl;
+        }
+        if (answered && !script_mode)
+            std::cout << config_tag_string("Compare")
+                      << "Keep an answer with " << cfg.command_symbol
+                      << "promote <number|model>" << std::endl;
+        if (script_mode)
+            keep_comparison(result);
+        else
+            last_comparison = std::move(result);
+    }
+
+    // The exchange a reply at the cursor follows, null at the start.
+    message_path::node_ptr cursor_node() const
+    {
+        size_t at = std::min(response_index, completion.messages.size());
+        return at ? completion.messages.node(at - 1) : nullptr;
+    }
+
+    // Scripts can't :promote, so every answer is kept: the first on the
+    // active branch and the rest as branches beside it for --export-tree.
+    void keep_comparison(comparison& result)
+    {
+        comparison_entry* first = nullptr;
+        for (auto& entry : result.entries)
+        {
+            if (!entry->error.empty())
+                continue;
+            if (!first)
+            {
+                first = entry.get();
+                continue;
+            }
+            completion.messages.push_back(
+                {result.user, std::move(entry->stream.message)});
+            completion.keep_branch();
+            completion.truncate(completion.messages.size() - 1);
+        }
+        if (!first)
+            return;
+        completion.messages.push_back(
+            {std::move(result.user), std::move(first->stream.message)});
+        record_sent_files(result.attached);
+        response_index++;
+    }
+
+    void promote_comparison(const std::string& choice)
+    {
+        auto& entries = last_comparison.entries;
+        auto  chosen  = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); it++)
+        {
+            if (choice == std::to_string(it - entries.begin() + 1) ||
+                choice == (*it)->label || choice == (*it)->model)
+            {
+                chosen = it;
+                break;
+            }
+        }
+        if (chosen == entries.end() || !(*chosen)->error.empty())
+        {
+            std::cerr << chat_cli::error_tag_string("Command Error")
+                      << (entries.empty() ? "Nothing to promote"
+                                          : "No answer '" + choice + "'")
+                      << std::endl;
+            return;
+        }
+        // Promoting onto a conversation that moved on would answer the
+        // wrong message
+        if (cursor_node() != last_comparison.base)
+        {
+            std::cerr << chat_cli::error_tag_string("Command Error")
+                      << "The conversation changed since that comparison"
+                      << std::endl;
+            return;
+        }
+
+        truncate_to_cursor();
+        completion.messages.push_back(
+            {std::move(last_comparison.user),
+             std::move((*chosen)->stream.message)});
+        record_sent_files(last_comparison.attached);
+        response_index++;
+        std::cout << config_tag_string("Promoted") << (*chosen)->label
+                  << std::endl;
+        last_comparison = comparison();
+    }
+
+    void record_usage(const std::string&                    model,
+                      const message_sse_dechunker&          stream,
+                      const net::response&                  response,
+                      std::chrono::steady_clock::time_point start,
+                      std::chrono::steady_clock::time_point end)
+    {
+        using seconds = std::chrono::duration<double>;
+        turn_usage    = stream.has_usage ? stream.usage : token_usage();
+        turn_usage.requests = 1;
+        turn_usage.read_transfer(response);
+        if (!stream.message.empty())
+        {
+            turn_usage.wait_seconds =
+                seconds(stream.first_token - start).count();
+            turn_usage.stream_seconds =
+                seconds(end - stream.first_token).count();
+        }
+        session_usage.add(turn_usage);
+        model_usage[model].add(turn_usage);
+    }
+
+    json usage_to_json() const
+    {
+        json models = json::object();
+        for (const auto& entry : model_usage)
+            models[entry.first] = entry.second.to_json();
+        return {{"session", session_usage.to_json()}, {"models", models}};
+    }
+
+    void print_token_counts(const json& request_object)
+    {
+        size_t total = defaults::REPLY_TOKENS;
+        size_t index = 0;
+        for (const auto& msg : request_object["messages"])
+        {
+            const std::string& content =
+                msg["content"].get_ref<const std::string&>();
+            size_t tokens = count_tokens(content) + defaults::MESSAGE_TOKENS;
+            total += tokens;
+            std::cout << config_tag_string("Tokens") << index++ << " "
+                      << msg["role"].get<std::string>() << ": " << tokens
+                      << std::endl;
+        }
+        std::cout << config_tag_string("Tokens") << "Total: " << total
+                  << (tokenizer.empty() ? " (estimated)" : "") << std::endl;
+    }
+
+    static std::vector<std::string> split_terms(const std::string& text)
+    {
+        std::vector<std::string> terms;
+        std::string              term;
+        for (size_t i = 0; i <= text.size(); i++)
+        {
+            unsigned char c = i < text.size() ? text[i] : ' ';
+            if (std::isalnum(c) || c == '_')
+            {
+                term += std::tolower(c);
+            }
+            else
+            {
+                if (term.size() >= 3)
+                    terms.push_back(term);
+                term.clear();
+            }
+        }
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+        return terms;
+    }
+
+    static size_t count_term_hits(std::string_view                text,
+                                  const std::vector<std::string>& terms,
+                                  size_t* first_hit = nullptr)
+    {
+        size_t hits = 0;
+        if (first_hit)
+            *first_hit = std::string_view::npos;
+        if (terms.empty())
+            return 0;
+        std::string lowered(text);
+        std::transform(lowered.begin(), lowered.end(), lowered.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+        for (const auto& term : terms)
+        {
+            size_t pos = lowered.find(term);
+            if (first_hit && pos < *first_hit)
+                *first_hit = pos;
+            for (; pos != std::string::npos; pos = lowered.find(term, pos + 1))
+                hits++;
+        }
+        return hits;
+    }
+
+    // Files to pack, relative to dir, from git when it's a repository so that
+    // .gitignore is honored, otherwise from a plain directory walk.
+    std::vector<std::string> list_pack_files(const std::string& dir,
+                                             bool&              is_git)
+    {
+        std::vector<std::string> files;
+        int                      rc = 0;
+        std::string listing = read_from_shell(
+            "git -C " + shell_quote(dir) +
+                " ls-files -z --cached --others --exclude-standard 2>/dev/null",
+            rc);
+        is_git = rc == 0;
+        if (is_git)
+        {
+            size_t start = 0;
+            for (size_t end; (end = listing.find('\0', start)) !=
+                             std::string::npos;
+                 start = end + 1)
+            {
+                files.push_back(listing.substr(start, end - start));
+            }
+        }
+        else
+        {
+            std::vector<std::string> unmatched;
+            std::string              prefix =
+                dir.back() == '/' ? dir : dir + "/";
+            for (auto& path : io::expand_paths({dir}, unmatched))
+            {
+                if (path.compare(0, prefix.size(), prefix) == 0)
+                    path.erase(0, prefix.size());
+                files.push_back(path);
+            }
+        }
+        return files;
+    }
+
+    bool pack_repository()
+    {
+        std::string dir        = prompt.get_next_arg();
+        std::string budget_arg = prompt.get_next_arg();
+        size_t      budget     = 0;
+        if (dir.empty() || budget_arg.empty())
+        {
+            std::cerr << chat_cli::error_tag_string("Command Error")
+                      << "Expected a directory and a token budget" << std::endl;
+            return false;
+        }
+        try
+        {
+            size_t end = 0;
+            if (budget_arg[0] != '-')
+                budget = std::stoul(budget_arg, &end);
+            if (end != budget_arg.size())
+                budget = 0;
+        }
+        catch (const std::exception& e)
+        {
+            budget = 0;
+        }
+        if (budget == 0)
+        {
+            std::cerr << chat_cli::error_tag_string("Command Error")
+                      << "Invalid token budget '" << budget_arg << "'"
+                      << std::endl;
+            return false;
+        }
+
+        std::string term_text = prompt_builder.str();
+        for (size_t i = 3; i < prompt.get_arg_count(); i++)
+            term_text += " " + prompt.get_next_arg();
+        std::vector<std::string> terms = split_terms(term_text);
+
+        bool                     is_git = false;
+        std::vector<std::string> files  = list_pack_files(dir, is_git);
+        if (files.empty())
+        {
+            std::cerr << chat_cli::error_tag_string("Command Error")
+                      << "No files found in '" << dir << "'" << std::endl;
+            return false;
+        }
+
+        // Most recently committed paths first.
+        std::unordered_map<std::string, size_t> recency;
+        if (is_git)
+        {
+            int         rc  = 0;
+            std::string log = read_from_shell(
+                "git -C " + shell_quote(dir) +
+                    " log --name-only --relative --format= -n " +
+                    std::to_string(defaults::PACK_HISTORY) + " 2>/dev/null",
+                rc);
+            std::istringstream ss(log);
+            std::string        line;
+            while (std::getline(ss, line))
+            {
+                if (!line.empty())
+                    recency.emplace(line, recency.size());
+            }
+        }
+
+        struct candidate
+        {
+            io::file_contents file;
+            std::string       name;
+            double            score;
+            size_t            first_hit;
+        };
+        std::vector<candidate> candidates;
+        std::vector<std::string> paths;
+        std::string prefix = (dir == "." || dir == "./") ? ""
+                             : dir.back() == '/'         ? dir
+                                                         : dir + "/";
+        for (const auto& file : files)
+            paths.push_back(prefix + file);
+
+        io::read_limits limits;
+        limits.max_file_size       = cfg.max_file_size;
+        limits.max_bytes_in_flight = defaults::MAX_READ_AHEAD;
+        size_t index               = 0;
+        io::read_files(paths, limits,
+                       [&](io::file_contents& file)
+                       {
+                           const std::string& name = files[index++];
+                           if (file.status != io::read_status::OK ||
+                               file.text().empty())
+                               return;
+                           candidate next = {std::move(file), name, 0, 0};
+                           std::string_view text = next.file.text();
+                           size_t hits = count_term_hits(text, terms,
+                                                         &next.first_hit);
+                           size_t path_hits = count_term_hits(name, terms);
+
+                           double score = std::log1p((double)hits) +
+                                          2.0 * (double)path_hits;
+                           auto recent = recency.find(name);
+                           if (recent != recency.end())
+                               score +=
+                                   2.0 /
+                                   (1.0 + std::log1p((double)recent->second));
+                           score -= 0.1 * std::log1p(
+                                              (double)count_tokens(text));
+                           next.score = score;
+                           candidates.push_back(std::move(next));
+                       });
+
+        std::stable_sort(candidates.begin(), candidates.end(),
+                         [](const candidate& a, const candidate& b)
+                         { return a.score > b.score; });
+
+        input.str("");
+        input << std::endl;
+        size_t used = 0, packed = 0, truncated = 0;
+        for (const auto& c : candidates)
+        {
+            std::string_view text   = c.file.text();
+            size_t           tokens = count_tokens(text);
+            if (used + tokens <= budget)
+            {
+                input << defaults::FILE_DELIMITER << c.name << std::endl;
+                input << text;
+                if (text.back() != '\n')
+                    input << std::endl;
+                input << defaults::FILE_DELIMITER << std::endl;
+                used += tokens;
+                packed++;
+                continue;
+            }
+
+            size_t remaining = budget - used;
+            if (remaining < defaults::PACK_MIN_SLICE)
+                continue;
+
+            // Keep whole lines around the first match, or from the top,
+            // adding up line counts to stay linear in the slice length.
+            io::line_index index(text);
+            size_t         line_count = index.line_count();
+            size_t         first      = 0;
+            if (c.first_hit != std::string_view::npos)
+            {
+                first = std::count(text.begin(), text.begin() + c.first_hit,
+                                   '\n');
+                first = first > 3 ? first - 3 : 0;
+            }
+            size_t last         = first;
+            size_t slice_tokens = count_tokens(index.lines(text, first, first));
+            if (slice_tokens > remaining)
+                continue;
+            while (last + 1 < line_count)
+            {
+                size_t line_tokens =
+                    count_tokens(index.lines(text, last + 1, last + 1)) + 1;
+                if (slice_tokens + line_tokens > remaining)
+                    break;
+                slice_tokens += line_tokens;
+                last++;
             }
+            std::string_view slice = index.lines(text, first, last);
+
+            input << defaults::FILE_DELIMITER << c.name << ":" << first + 1
+                  << "," << last + 1 << std::endl;
+            input << slice << std::endl;
+            input << defaults::FILE_DELIMITER << std::endl;
+            used += slice_tokens;
+            packed++;
+            truncated++;
         }
-        return "";
+
+        std::cout << config_tag_string("Pack") << packed << " of "
+                  << candidates.size() << " files";
+        if (truncated)
+            std::cout << " (" << truncated << " truncated)";
+        std::cout << ", ~" << used << " of " << budget << " tokens"
+                  << std::endl;
+        return packed > 0;
     }
 
-    bool add_files_to_prompt()
+    // Marks attachments as carried by the exchange just appended at
+    // response_index.
+    void record_sent_files(std::unordered_map<std::string, sent_file>& attached)
     {
-        bool send       = false;
-        int  file_count = std::max<int>((int)prompt.get_arg_count() - 1, 0);
-        input.str("");
-        input << std::endl;
-        if (file_count == 0)
+        for (auto& pending : attached)
         {
-            std::cerr << chat_cli::error_tag_string("Command Error")
-                      << "No files given" << std::endl;
+            sent_file& file = pending.second;
+            file.exchange   = response_index;
+            file.node       = completion.messages.node(response_index);
+            if (file.diff.empty())
+                file.base = response_index;
+            file.diff.clear();
+            sent_files[pending.first] = std::move(file);
         }
+    }
 
-        for (int file_index = 0; file_index < file_count; file_index++)
+    static std::string file_block(const std::string& path,
+                                  std::string_view   text)
+    {
+        return defaults::FILE_DELIMITER + path + "\n" + std::string(text) +
+               defaults::FILE_DELIMITER + "\n";
+    }
+
+    // The windowed request for message_text. A diff against an exchange the
+    // window drops or elides is first swapped back for the full file, since
+    // the model would not see what it applies to.
+    json create_message_request(std::string& message_text)
+    {
+        while (true)
         {
-            std::string   file_name = prompt.get_next_arg();
-            std::ifstream fs(file_name);
-            if (fs.is_open())
+            json request_object = create_windowed_request(message_text);
+            bool replaced       = false;
+            for (auto& pending : pending_files)
             {
-                input << defaults::FILE_DELIMITER << file_name << std::endl;
-                input << std::string((std::istreambuf_iterator<char>(fs)),
-                                     std::istreambuf_iterator<char>());
-                input << defaults::FILE_DELIMITER << std::endl;
-                send = true;
+                sent_file& file = pending.second;
+                if (file.diff.empty() || file.base >= completion.full_start)
+                    continue;
+                size_t at = message_text.find(file.diff);
+                if (at != std::string::npos)
+                    message_text.replace(at, file.diff.size(),
+                                         file_block(pending.first, file.text));
+                file.diff.clear();
+                replaced = true;
             }
-            else
+            // The full text makes the message longer, which may move the
+            // window again
+            if (!replaced)
+                return request_object;
+        }
+    }
+
+    // Whether the exchange that carried a file is still on the active branch
+    // before the cursor, with the full text not yet summarized away.
+    bool still_sent(const sent_file& sent) const
+    {
+        return sent.base >= completion.summarized &&
+               sent.exchange < response_index &&
+               sent.exchange < completion.messages.size() &&
+               completion.messages.node(sent.exchange) == sent.node.lock();
+    }
+
+    // Appends a file to the input, as a diff when an earlier version of it is
+    // still part of the conversation and the diff is meaningfully smaller.
+    void attach_file(const std::string& path, std::string_view text)
+    {
+        size_t hash = std::hash<std::string_view>()(text);
+        auto   sent = sent_files.find(path);
+        if (cfg.attach_diffs && sent != sent_files.end() &&
+            still_sent(sent->second))
+        {
+            std::string patch, note;
+            if (sent->second.hash == hash && sent->second.text == text)
+                note = file_block(path,
+                                  "(unchanged since it was last attached)\n");
+            else if (diff::unified(sent->second.text, text, path, patch) &&
+                     patch.size() < text.size() * defaults::DIFF_MAX_RATIO)
+                note = file_block("diff", patch);
+            if (!note.empty())
             {
-                std::cerr << file_error_tag_string(file_name) << std::endl;
+                input << note;
+                pending_files[path] = {hash,
+                                       0,
+                                       std::string(text),
+                                       {},
+                                       sent->second.base,
+                                       std::move(note)};
+                return;
             }
         }
 
-        return send;
+        input << file_block(path, text);
+        pending_files[path] = {hash, 0, std::string(text), {}, 0, {}};
     }
 
     bool less_output_with_fallback(const std::string& output_str)
@@ -1013,7 +3642,7 @@ public:
         return pclose(pipe);
     }
 
-    int pipe_from_shell(const std::string& shell_cmd)
+    static std::string read_from_shell(const std::string& shell_cmd, int& rc)
     {
         if (shell_cmd.empty())
             throw std::invalid_argument("No shell command provided");
@@ -1022,11 +3651,32 @@ public:
         if (!pipe)
             throw std::runtime_error("Failed to run shell command");
 
-        char buffer[256];
-        while (fgets(buffer, sizeof(buffer), pipe) != nullptr)
-            output += buffer;
+        char   buffer[4096];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+            output.append(buffer, count);
+
+        rc = pclose(pipe);
+        return output;
+    }
+
+    static std::string shell_quote(const std::string& arg)
+    {
+        std::string quoted = "'";
+        for (char c : arg)
+        {
+            if (c == '\'')
+                quoted += "'\\''";
+            else
+                quoted += c;
+        }
+        return quoted + "'";
+    }
 
-        int rc = pclose(pipe);
+    int pipe_from_shell(const std::string& shell_cmd)
+    {
+        int         rc     = 0;
+        std::string output = read_from_shell(shell_cmd, rc);
         input.str("");
         input << defaults::FILE_DELIMITER << shell_cmd << std::endl
               << output << defaults::FILE_DELIMITER << std::endl;
@@ -1044,7 +3694,15 @@ public:
 
     int command_loop()
     {
-        if (cfg.api_key.empty())
+        if (!cfg.index_dir.empty())
+        {
+            if (!open_index(cfg.index_dir, false))
+                return -1;
+            if (script_mode && cfg.input_file_name.empty())
+                return 0;
+        }
+
+        if (cfg.api_key.empty() && !cfg.count_tokens)
         {
             std::cerr << error_tag_string("Api Key Required") << std::endl;
             std::cerr << "Please provide an api key." << std::endl;
@@ -1077,8 +3735,8 @@ public:
 
         if (!cfg.input_file_name.empty())
         {
-            input_file = std::ifstream(cfg.input_file_name);
-            if (!input_file.is_open())
+            input_fd = open(cfg.input_file_name.c_str(), O_RDONLY | O_CLOEXEC);
+            if (input_fd < 0)
             {
                 std::cerr << file_error_tag_string(cfg.input_file_name)
                           << std::endl;
@@ -1088,43 +3746,84 @@ public:
 
         if (!cfg.import_chat_file_name.empty())
             import_from_file(cfg.import_chat_file_name);
+        profile.mark("import");
 
-        client.default_headers["Authorization"] = "Bearer " + cfg.api_key;
+        client.set_default_header("Authorization", "Bearer " + cfg.api_key);
         do
         {
             input.str("");
-            bool send_chat = true;
+            bool        send_chat = true;
+            std::string message_text;
             if (!script_mode)
             {
-                input << prompt.read_para(
+                profile.print();
+                finish_compaction();
+                start_compaction();
+                message_text = prompt.read_para(
                     building_prompt ? ">" : chat_cli::user_tag_string());
-                if (!input.str().empty())
+                if (!message_text.empty() &&
+                    message_text[0] == cfg.command_symbol)
                 {
-                    if (input.str()[0] == cfg.command_symbol)
-                        send_chat = process_commands();
+                    send_chat = process_commands();
+                    if (send_chat)
+                        message_text = input.str();
                 }
             }
             else
             {
-                send_chat = process_input_stream(
-                    input_file.is_open() ? input_file : std::cin);
+                send_chat = process_input_stream(input_fd, message_text);
+                if (input_fd != STDIN_FILENO)
+                {
+                    close(input_fd);
+                    input_fd = STDIN_FILENO;
+                }
+                profile.mark("input");
+            }
+
+            if (cfg.count_tokens && (send_chat || script_mode))
+            {
+                json request_object = create_message_request(message_text);
+                if (send_chat)
+                    request_object["messages"].push_back(
+                        {{"role", "user"}, {"content", message_text}});
+                print_token_counts(request_object);
+                break;
             }
 
             if (send_chat)
             {
                 if (building_prompt)
                 {
-                    prompt_builder << input.str() << std::endl;
+                    prompt_builder << message_text << std::endl;
                 }
                 else
                 {
-                    if (completion.messages.size() > response_index)
-                        completion.messages.resize(response_index);
-                    json request_object = completion.create_request(cfg);
-                    json next_message   = {{"role", "user"},
-                                           {"content", input.str()}};
+                    if (ask_mode)
+                        message_text += retrieve_chunks(message_text);
+                    truncate_to_cursor();
+                    finish_compaction();
+                    json request_object = create_message_request(message_text);
+                    std::string cache_key =
+                        completion.cache_key(cfg, message_text);
+                    // Dropped again per server by the sends below
+                    if (cfg.cache_key)
+                        request_object["prompt_cache_key"] = cache_key;
+                    request_object["messages"].push_back(
+                        {{"role", "user"},
+                         {"content", std::move(message_text)}});
 
-                    request_object["messages"].push_back(next_message);
+                    std::vector<std::string> targets =
+                        compare_next.empty() ? cfg.compare_models
+                                             : std::move(compare_next);
+                    compare_next.clear();
+                    if (!targets.empty())
+                    {
+                        compare(targets, request_object);
+                        // Skips the single request below, not the export
+                        if (!cfg.export_chat_file_name.empty())
+                            export_to_file(cfg.export_chat_file_name);
+                        continue;
+                    }
 
                     sse = message_sse_dechunker();
                     sse.callback =
@@ -1132,28 +3831,20 @@ public:
                     {
                         if (!data.empty())
                         {
-                            try
+                            std::string chunk_string =
+                                read_stream_chunk(sse, data);
+                            if (!chunk_string.empty())
                             {
-                                nlohmann::json content = nlohmann::json::parse(
-                                    data)["choices"][0]["delta"]["content"];
-                                if (content.is_string())
+                                if (sse.message.empty())
+                                    profile.mark("first token");
+                                if (!sse.started)
                                 {
-                                    std::string chunk_string =
-                                        content.get<std::string>();
-                                    if (!sse.started)
-                                    {
-                                        sse.started = true;
-                                        std::cout << chat_cli::bot_tag_string();
-                                    }
-                                    std::cout << chunk_string;
-                                    std::cout.flush();
-                                    sse.message.append(chunk_string);
+                                    sse.started = true;
+                                    std::cout << chat_cli::bot_tag_string();
                                 }
-                            }
-                            catch (const std::exception& e)
-                            {
-                                if (data.find("[DONE]") != std::string::npos)
-                                    sse.done = true;
+                                std::cout << chunk_string;
+                                std::cout.flush();
+                                sse.message.append(chunk_string);
                             }
                         }
                     };
@@ -1162,21 +3853,32 @@ public:
                         sse.started = true;
 
 #if 0
-                    std::cout << cli::set_format(
-                                     next_message["content"].get<std::string>(),
-                                     cli::format::RED)
+                    std::cout << cli::set_format(request_object["messages"]
+                                                     .back()["content"]
+                                                     .get<std::string>(),
+                                                 cli::format::RED)
                               << std::endl;
 #endif
                     if (cfg.extract_code)
                         request_object["stream"] = false;
-                    net::url req_url(cfg.base_url);
-                    if (req_url.path.empty() || req_url.path == "/")
-                        req_url.path = defaults::COMPLETIONS_ENDPOINT;
-                    net::request req = {
-                        req_url, net::http_method::POST, {}, request_object};
+                    else if (cfg.stream_usage)
+                        request_object["stream_options"] = {
+                            {"include_usage", true}};
+                    if (!sends_cache_key(completions_url(cache_key)))
+                        request_object.erase("prompt_cache_key");
+                    net::request req(completions_url(cache_key),
+                                     net::http_method::POST);
+                    req.set_pieces(message_body(request_object),
+                                   "application/json");
                     if (!cfg.extract_code)
                         req.subscribe(net::sse_dechunker_callback, &sse);
+                    profile.mark("request body");
+                    auto request_start     = std::chrono::steady_clock::now();
                     net::response response = client.send(req);
+                    auto request_end       = std::chrono::steady_clock::now();
+                    profile.mark("response");
+                    std::unordered_map<std::string, sent_file> attached;
+                    attached.swap(pending_files);
 
 #if 0
                     std::cout << cli::set_format(response.to_string(),
@@ -1216,28 +3918,51 @@ public:
                     }
                     else
                     {
+                        json response_json;
+                        if (cfg.extract_code)
+                        {
+                            static const json::json_pointer content_path(
+                                "/choices/0/message/content");
+                            response_json = json::parse(response.to_string(),
+                                                        nullptr, false);
+                            if (!response_json.contains(content_path) ||
+                                !response_json[content_path].is_string())
+                                throw std::runtime_error(
+                                    "Unexpected server response");
+                            sse.message =
+                                response_json[content_path].get<std::string>();
+                            if (response_json["usage"].is_object())
+                            {
+                                sse.usage.read(response_json["usage"]);
+                                sse.has_usage = true;
+                            }
+                            sse.first_token = request_end;
+                        }
+                        record_usage(cfg.model, sse, response, request_start,
+                                     request_end);
+
+                        // The request body has already been serialized, so
+                        // the user text can move into the history uncopied.
                         completion.messages.push_back(
-                            {input.str(), sse.message});
+                            {std::move(request_object["messages"]
+                                           .back()["content"]
+                                           .get_ref<std::string&>()),
+                             sse.message});
+                        record_sent_files(attached);
                         response_index++;
 
                         if (cfg.extract_code)
                         {
-                            json response_json =
-                                json::parse(response.to_string());
-
-                            std::string content =
-                                response_json["choices"][0]["message"]
-                                             ["content"]
-                                                 .get<std::string>();
-
                             std::string code_block = extract_code_block(
-                                content, cfg.extract_language_ident_filters);
+                                completion.messages.back().assistant,
+                                cfg.extract_language_ident_filters);
                             if (code_block.empty())
                                 return -1;
                             std::cout << code_block;
                         }
                     }
                     std::cout << std::endl;
+                    profile.print();
                 }
             }
             if (!cfg.export_chat_file_name.empty())
@@ -1246,25 +3971,419 @@ public:
         return 0;
     }
 
-    bool process_input_stream(std::istream& stream)
+    // Answers clients on a Unix socket, one thread per connection. Upstream
+    // clients are pooled so their connections stay open between requests.
+    int serve_daemon()
     {
-        char c;
-        bool send_chat = true;
-        input.str("");
-        do
+        if (cfg.api_key.empty())
+        {
+            std::cerr << error_tag_string("Api Key Required") << std::endl;
+            return -1;
+        }
+        load_tokenizer();
+        std::string path = cfg.socket_path.empty() ? ipc::default_socket_path()
+                                                   : cfg.socket_path;
+        ipc::listener listener(path);
+        std::cout << config_tag_string("Daemon") << "Listening on " << path
+                  << std::endl;
+        try
+        {
+            while (true)
+                daemon_connections.start(listener.accept(),
+                                         [this](ipc::connection& conn)
+                                         { serve_connection(conn); });
+        }
+        catch (const std::exception& e)
+        {
+            daemon_connections.stop();
+            std::cerr << error_tag_string("Daemon Error") << e.what()
+                      << std::endl;
+            return -1;
+        }
+    }
+
+    void serve_connection(ipc::connection& conn)
+    {
+        try
         {
-            stream.get(c);
-            if (stream.eof())
+            ipc::frame request;
+            while (conn.receive(request) &&
+                   request.type == ipc::frame_type::REQUEST)
             {
-                prompt.keep_alive = false;
-                send_chat         = !input.str().empty();
+                json status = answer_client(conn, request.payload);
+                if (!conn.send(ipc::frame_type::END, status.dump()))
+                    break;
             }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << error_tag_string("Daemon Error") << e.what()
+                      << std::endl;
+        }
+    }
+
+    json answer_client(ipc::connection& conn, const std::string& payload)
+    {
+        json        request;
+        std::string user, name;
+        chat_config settings = cfg;
+        try
+        {
+            request = json::parse(payload);
+            user    = request.value("message", "");
+            name    = request.value("session", "");
+            if (request.contains("settings"))
+                settings.apply_settings(request["settings"]);
+        }
+        catch (const std::exception& e)
+        {
+            return {{"error", "Malformed request"}};
+        }
+
+        auto session = std::make_shared<daemon_session>();
+        if (!name.empty())
+        {
+            std::lock_guard<std::mutex> lock(daemon_mutex);
+            auto& named = daemon_sessions[name];
+            if (!named)
+                named = session;
+            session            = named;
+            session->last_used = std::chrono::steady_clock::now();
+            prune_sessions(session->last_used);
+        }
+        std::lock_guard<std::mutex> session_lock(session->lock);
+        chat_completion&            conversation = session->completion;
+
+        json request_object =
+            create_windowed_request(conversation, user, settings);
+        std::string cache_key = conversation.cache_key(settings, user);
+        if (sends_cache_key(completions_url(cache_key)))
+            request_object["prompt_cache_key"] = cache_key;
+        request_object["messages"].push_back(
+            {{"role", "user"}, {"content", user}});
+        if (cfg.stream_usage)
+            request_object["stream_options"] = {{"include_usage", true}};
+
+        message_sse_dechunker stream;
+        stream.callback = [&](const std::string&, const std::string& data)
+        {
+            if (data.empty())
+                return;
+            std::string delta = read_stream_chunk(stream, data);
+            if (delta.empty())
+                return;
+            stream.started = true;
+            stream.message.append(delta);
+            conn.send(ipc::frame_type::DATA, delta);
+        };
+
+        std::unique_ptr<net::client> upstream = take_client();
+        net::request req(completions_url(cache_key), net::http_method::POST);
+        req.set_pieces(message_body(request_object), "application/json");
+        req.subscribe(net::sse_dechunker_callback, &stream);
+        net::response response = upstream->send(req);
+        return_client(std::move(upstream));
+
+        if (response.curl_code != CURLE_OK || response.response_code != 200)
+            return {{"error", response_error(response)}};
+        if (stream.unexpected_response)
+            return {{"error", "Unexpected server response"}};
+        conversation.messages.push_back({std::move(user), stream.message});
+        json status = {{"ok", true}};
+        if (stream.has_usage)
+            status["usage"] = stream.usage.to_json();
+        return status;
+    }
+
+    // Drops named sessions idle for SESSION_IDLE, then the least recently
+    // used beyond DAEMON_SESSIONS. Sessions a request still holds are kept,
+    // so a conversation is never split in two. Called under daemon_mutex.
+    void prune_sessions(std::chrono::steady_clock::time_point now)
+    {
+        auto idle_limit = now - std::chrono::seconds(defaults::SESSION_IDLE);
+        auto oldest     = daemon_sessions.end();
+        for (auto it = daemon_sessions.begin(); it != daemon_sessions.end();)
+        {
+            if (it->second.use_count() > 1)
+                it++;
+            else if (it->second->last_used < idle_limit)
+                it = daemon_sessions.erase(it);
             else
             {
-                input << c;
+                if (oldest == daemon_sessions.end() ||
+                    it->second->last_used < oldest->second->last_used)
+                    oldest = it;
+                it++;
             }
-        } while (prompt.keep_alive);
-        return send_chat;
+        }
+        if (daemon_sessions.size() > defaults::DAEMON_SESSIONS &&
+            oldest != daemon_sessions.end())
+            daemon_sessions.erase(oldest);
+    }
+
+    // An idle upstream client, so connections are reused across threads.
+    std::unique_ptr<net::client> take_client()
+    {
+        {
+            std::lock_guard<std::mutex> lock(daemon_mutex);
+            if (!idle_clients.empty())
+            {
+                auto upstream = std::move(idle_clients.back());
+                idle_clients.pop_back();
+                return upstream;
+            }
+        }
+        auto upstream = std::make_unique<net::client>();
+        configure_transfer(*upstream);
+        upstream->set_default_header("Authorization", "Bearer " + cfg.api_key);
+        return upstream;
+    }
+
+    void return_client(std::unique_ptr<net::client> upstream)
+    {
+        std::lock_guard<std::mutex> lock(daemon_mutex);
+        idle_clients.push_back(std::move(upstream));
+    }
+
+    // An OpenAI compatible endpoint for other local tools, forwarding through
+    // the pooled clients so they share warm upstream connections.
+    int serve_http()
+    {
+        net::server listener(cfg.serve_address);
+        std::cout << config_tag_string("Proxy") << "Listening on "
+                  << cfg.serve_address << ", forwarding to "
+                  << completions_url().to_string() << std::endl;
+        if (cfg.serve_token.empty())
+        {
+            std::random_device random;
+            std::ostringstream token;
+            token << "jp-" << std::hex;
+            for (int i = 0; i < 4; i++)
+                token << std::setw(8) << std::setfill('0') << random();
+            cfg.serve_token = token.str();
+            std::cout << config_tag_string("Proxy") << "Callers use API key "
+                      << cfg.serve_token << std::endl;
+        }
+        try
+        {
+            while (true)
+                http_connections.start(listener.accept(),
+                                       [this](net::server_connection& conn)
+                                       { serve_http_connection(conn); });
+        }
+        catch (const std::exception& e)
+        {
+            http_connections.stop();
+            std::cerr << error_tag_string("Proxy Error") << e.what()
+                      << std::endl;
+            return -1;
+        }
+    }
+
+    void serve_http_connection(net::server_connection& conn)
+    {
+        try
+        {
+            net::incoming_request request;
+            while (conn.read_request(request))
+            {
+                if (!proxy_request(conn, request) || !request.keep_alive())
+                    break;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << error_tag_string("Proxy Error") << e.what()
+                      << std::endl;
+        }
+    }
+
+    static void relay_reply(const uint8_t* bytes, size_t size, void* userp,
+                            bool is_header)
+    {
+        proxied_reply* reply = static_cast<proxied_reply*>(userp);
+        std::string_view text(reinterpret_cast<const char*>(bytes), size);
+        if (is_header)
+        {
+            // The last status line wins over interim ones like 100 Continue
+            if (text.compare(0, 5, "HTTP/") == 0)
+            {
+                size_t space  = text.find(' ');
+                reply->status = space == std::string_view::npos
+                                    ? 0
+                                    : atoi(std::string(text.substr(space + 1))
+                                               .c_str());
+            }
+            else if (text.size() > 13 &&
+                     strncasecmp(text.data(), "content-type:", 13) == 0)
+            {
+                std::string value(text.substr(13));
+                value.erase(0, value.find_first_not_of(" \t"));
+                value.erase(value.find_last_not_of(" \t\r\n") + 1);
+                reply->content_type = std::move(value);
+            }
+            return;
+        }
+        if (reply->failed)
+            return;
+        if (!reply->started)
+        {
+            reply->started = true;
+            net::header_list headers;
+            if (!reply->content_type.empty())
+                headers.emplace_back("Content-Type", reply->content_type);
+            headers.emplace_back("X-Cache", "MISS");
+            reply->failed = !reply->conn->begin_stream(reply->status, headers);
+        }
+        if (!reply->failed)
+            reply->failed = !reply->conn->send_chunk(text);
+    }
+
+    // False when the client connection can't be used any more.
+    // Takes the body out of request, sharing it with the upstream transfer
+    // and the cache.
+    bool proxy_request(net::server_connection& conn,
+                       net::incoming_request&  request)
+    {
+        auto send_error = [&](int status, const std::string& message,
+                              net::header_list headers = {})
+        {
+            headers.emplace_back("Content-Type", "application/json");
+            return conn.send_response(
+                status, headers,
+                json({{"error", {{"message", message}}}}).dump());
+        };
+
+        std::string path = request.target.substr(0, request.target.find('?'));
+        const std::string suffix = "/chat/completions";
+        if (request.method != "POST" || path.size() < suffix.size() ||
+            path.compare(path.size() - suffix.size(), suffix.size(), suffix))
+            return send_error(404, "Only POST /v1/chat/completions is proxied");
+
+        double wait = proxy_limiter.acquire();
+        if (wait > 0)
+            return send_error(
+                429, "Rate limit reached",
+                {{"Retry-After", std::to_string((int)std::ceil(wait))}});
+
+        // Browser pages can post to a local port without a preflight only
+        // with a simple content type, and announce themselves with Origin
+        const std::string* content_type = request.header("content-type");
+        if (!content_type ||
+            strncasecmp(content_type->c_str(), "application/json", 16) != 0)
+            return send_error(415, "Expected Content-Type application/json");
+        if (request.header("origin"))
+            return send_error(403, "Cross-origin requests are not proxied");
+
+        // The configured key is lent to callers holding the proxy token, or
+        // to everyone when sharing it was asked for. Other keys pass through
+        const std::string* client_auth = request.header("authorization");
+        std::string        authorization;
+        if (client_auth && *client_auth != "Bearer " + cfg.serve_token)
+            authorization = *client_auth;
+        else if (client_auth || cfg.serve_shared_key)
+            authorization = "Bearer " + cfg.api_key;
+        else
+            return send_error(401, "Missing Authorization header");
+        reply_key    cache_key = {authorization,
+                                  net::shared_bytes(std::move(request.body))};
+        cached_reply cached;
+        if (cfg.response_cache && proxy_cache.get(cache_key, cached))
+            return conn.send_response(
+                200,
+                {{"Content-Type", cached.content_type}, {"X-Cache", "HIT"}},
+                cached.body.view());
+
+        net::request req(completions_url(), net::http_method::POST,
+                         {{"Authorization", authorization}});
+        req.set_data(cache_key.body, "application/json");
+        proxied_reply reply;
+        reply.conn = &conn;
+        req.subscribe(relay_reply, &reply);
+
+        std::unique_ptr<net::client> upstream = take_client();
+        net::response response = upstream->send(req);
+        return_client(std::move(upstream));
+
+        if (reply.started)
+        {
+            // A broken upstream stream can only be signalled by closing
+            if (response.curl_code != CURLE_OK || reply.failed ||
+                !conn.end_stream())
+                return false;
+        }
+        else if (response.curl_code != CURLE_OK)
+        {
+            return send_error(502, curl_easy_strerror(response.curl_code));
+        }
+        else if (!conn.send_response(response.response_code,
+                                     {{"Content-Type", reply.content_type}},
+                                     ""))
+        {
+            return false;
+        }
+
+        if (cfg.response_cache && response.response_code == 200)
+            proxy_cache.put(cache_key,
+                            {reply.content_type,
+                             net::shared_bytes(std::move(response.body))});
+        return true;
+    }
+
+    // The --client side: no curl or readline, just the socket round trip.
+    static int forward_to_daemon(const chat_config& cfg)
+    {
+        int fd = STDIN_FILENO;
+        if (!cfg.input_file_name.empty())
+        {
+            fd = open(cfg.input_file_name.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                std::cerr << file_error_tag_string(cfg.input_file_name)
+                          << std::endl;
+                return -1;
+            }
+        }
+        std::string message_text = io::read_all(fd);
+        if (fd != STDIN_FILENO)
+            close(fd);
+
+        ipc::connection conn = ipc::connection::connect(
+            cfg.socket_path.empty() ? ipc::default_socket_path()
+                                    : cfg.socket_path);
+        json request = {{"message", std::move(message_text)},
+                        {"session", cfg.session},
+                        {"settings", cfg.given_settings()}};
+        ipc::frame reply;
+        reply.type = ipc::frame_type::REQUEST;
+        if (conn.send(ipc::frame_type::REQUEST, request.dump()))
+        {
+            while (conn.receive(reply) && reply.type == ipc::frame_type::DATA)
+                std::cout << reply.payload << std::flush;
+        }
+
+        if (reply.type != ipc::frame_type::END)
+        {
+            std::cerr << error_tag_string("Daemon Error")
+                      << "Connection closed mid-reply" << std::endl;
+            return -1;
+        }
+        json status = json::parse(reply.payload);
+        if (status.contains("error"))
+        {
+            std::cerr << error_tag_string("API Error")
+                      << status["error"].get<std::string>() << std::endl;
+            return -1;
+        }
+        std::cout << std::endl;
+        return 0;
+    }
+
+    bool process_input_stream(int fd, std::string& message_text)
+    {
+        message_text      = io::read_all(fd);
+        prompt.keep_alive = false;
+        return !message_text.empty();
     }
 
     bool process_commands()
@@ -1279,8 +4398,16 @@ public:
                 std::vector<const runtime_command*> matches;
                 for (const auto& cmd : commands)
                 {
-                    if (cmd.title.substr(0, command.size()) == command)
-                        matches.push_back(&cmd);
+                    if (cmd.title.substr(0, command.size()) != command)
+                        continue;
+                    // A full name wins over longer names it is a prefix of
+                    if (cmd.title.size() == command.size() ||
+                        cmd.title[command.size()] == ' ')
+                    {
+                        matches = {&cmd};
+                        break;
+                    }
+                    matches.push_back(&cmd);
                 }
 
                 if (matches.size() == 1)
@@ -1340,7 +4467,14 @@ public:
 
     void export_to_file(const std::string& file_name)
     {
-        json          export_json = completion.create_request(cfg);
+        export_to_file(file_name, cfg.export_tree);
+    }
+
+    void export_to_file(const std::string& file_name, bool with_tree)
+    {
+        json export_json = completion.export_request(cfg, with_tree);
+        if (session_usage.requests)
+            export_json["usage"] = usage_to_json();
         std::ofstream fs(file_name);
         if (!fs.is_open())
         {
@@ -1378,6 +4512,67 @@ public:
         }
     }
 
+    // Brings the index of dir up to date and maps it for searching.
+    bool open_index(const std::string& dir, bool quiet)
+    {
+        try
+        {
+            search::build_stats stats = search::build(dir);
+            archive = std::make_unique<search::index>(dir);
+            if (!quiet)
+                std::cout << config_tag_string("Index") << stats.files
+                          << " files, " << stats.exchanges << " exchanges, "
+                          << stats.terms << " terms"
+                          << (stats.rebuilt ? "" : ", unchanged") << std::endl;
+            return true;
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << chat_cli::error_tag_string("Index Error") << e.what()
+                      << std::endl;
+            return false;
+        }
+    }
+
+    // Lists the hits for query, numbered for :import #n.
+    size_t search_archive(const std::string& query)
+    {
+        auto start = std::chrono::steady_clock::now();
+        last_hits  = archive->find(query, defaults::SEARCH_HITS);
+        double ms  = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+        for (size_t i = 0; i < last_hits.size(); i++)
+        {
+            const search::hit& hit = last_hits[i];
+            std::cout << config_tag_string(std::to_string(i + 1)) << hit.path
+                      << " #" << hit.exchange + 1 << " "
+                      << cli::set_format(hit.snippet, cli::format::BLUE)
+                      << std::endl;
+        }
+        std::cerr << config_tag_string("Search") << last_hits.size()
+                  << " hits in " << archive->exchange_count()
+                  << " exchanges, "
+                  << std::fixed << std::setprecision(2) << ms << " ms"
+                  << std::defaultfloat << std::endl;
+        return last_hits.size();
+    }
+
+    int search_command()
+    {
+        // Only an index asked for with --index is built, never the cwd's
+        if (cfg.index_dir.empty())
+        {
+            std::cerr << chat_cli::error_tag_string("Index Error")
+                      << "No index, pass --index DIR with --search"
+                      << std::endl;
+            return -1;
+        }
+        if (!open_index(cfg.index_dir, true))
+            return -1;
+        return search_archive(cfg.search_query) ? 0 : 1;
+    }
+
     void import_from_file(const std::string& file_name)
     {
         std::ifstream fs = std::ifstream(file_name);
@@ -1390,6 +4585,7 @@ public:
                                 std::istreambuf_iterator<char>()));
                 cfg.import(j);
                 response_index = completion.import_messages(j);
+                sent_files.clear();
             }
             catch (const std::exception& e)
             {
@@ -1406,30 +4602,11 @@ public:
             std::cerr << file_error_tag_string(file_name) << std::endl;
         }
     }
-
-    std::vector<std::string> split_lines(const std::string& multi_line)
-    {
-        std::vector<std::string> lines;
-        size_t                   start = 0;
-        size_t                   pos   = 0;
-
-        while (pos <= multi_line.length())
-        {
-            if (pos == multi_line.length() || multi_line[pos] == '\n' ||
-                multi_line[pos] == '\r')
-            {
-                lines.push_back(multi_line.substr(start, pos - start));
-                start = pos + 1;
-            }
-            pos++;
-        }
-
-        return lines;
-    }
 };
 
 int main(int argc, char** argv)
 {
+    startup_profile profile(std::chrono::steady_clock::now());
     try
     {
         cli::shell_args<chat_config> parsed_args(
@@ -1438,8 +4615,16 @@ int main(int argc, char** argv)
             chat_config::get_shell_title());
 
         chat_config cfg = parsed_args.get_arguments();
-        chat_cli    cli(cfg);
-        return cli.command_loop();
+        profile.enabled = cfg.startup_profile;
+        profile.mark("arguments");
+        if (cfg.client_mode)
+            return chat_cli::forward_to_daemon(cfg);
+        chat_cli cli(cfg, profile);
+        if (!cfg.search_query.empty())
+            return cli.search_command();
+        if (!cfg.serve_address.empty())
+            return cli.serve_http();
+        return cfg.daemon ? cli.serve_daemon() : cli.command_loop();
     }
     catch (const std::exception& e)
     {
@@ -1,43 +1,492 @@
 #include "net.h"
 #include <stdexcept>
-#include <sstream>
 #include <algorithm>
+#include <array>
 #include <unordered_map>
 #include <string>
 #include <vector>
+#include <mutex>
+#include <cstring>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A deflate stream appending to out, for one body.
+class deflater
+{
+public:
+    explicit deflater(net::content_encoding encoding)
+    {
+        // Fastest level: this runs on every turn and text shrinks well anyway
+        int window_bits =
+            encoding == net::content_encoding::GZIP ? 15 + 16 : 15;
+        if (deflateInit2(&stream_, Z_BEST_SPEED, Z_DEFLATED, window_bits, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("Compression initialization failed");
+    }
+    deflater(const deflater&)            = delete;
+    deflater& operator=(const deflater&) = delete;
+    ~deflater() { deflateEnd(&stream_); }
 
-// net::client
-void net::client::ensure_curl_initialized()
+    void write(const uint8_t* bytes, size_t size, bool last)
+    {
+        stream_.next_in  = const_cast<Bytef*>(bytes);
+        stream_.avail_in = size;
+        int rc;
+        do
+        {
+            size_t used = out.size();
+            out.resize(used + std::max<size_t>(deflateBound(&stream_, size),
+                                               1 << 14));
+            stream_.next_out  = out.data() + used;
+            stream_.avail_out = out.size() - used;
+            rc = deflate(&stream_, last ? Z_FINISH : Z_NO_FLUSH);
+            out.resize(out.size() - stream_.avail_out);
+            if (rc == Z_STREAM_ERROR)
+                throw std::runtime_error("Compression failed");
+        } while (stream_.avail_in || (last && rc != Z_STREAM_END));
+    }
+
+    std::vector<uint8_t> out;
+
+private:
+    z_stream stream_ = {};
+};
+
+std::vector<uint8_t> net::compress(const uint8_t* bytes, size_t size,
+                                   net::content_encoding encoding)
+{
+    deflater compressor(encoding);
+    compressor.write(bytes, size, true);
+    return std::move(compressor.out);
+}
+
+// Only the compressed copy of the body is ever held whole.
+static std::vector<uint8_t> compress(net::body_reader&     reader,
+                                     net::content_encoding encoding)
+{
+    deflater compressor(encoding);
+    uint8_t  block[1 << 16];
+    size_t   got;
+    do
+    {
+        got = reader.read(block, sizeof(block));
+        compressor.write(block, got, got < sizeof(block));
+    } while (got == sizeof(block));
+    return std::move(compressor.out);
+}
+
+static bool needs_escape(unsigned char c)
+{
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+// The escaped form of c when it needs one, as nlohmann::json writes it.
+static size_t escape_json(unsigned char c, char* out)
 {
-    static bool initialized = false;
-    if (!initialized)
+    const char* shorthand = nullptr;
+    switch (c)
     {
-        curl_global_init(CURL_GLOBAL_ALL);
-        atexit(curl_global_cleanup);
-        initialized = true;
+    case '"':
+        shorthand = "\\\"";
+        break;
+    case '\\':
+        shorthand = "\\\\";
+        break;
+    case '\b':
+        shorthand = "\\b";
+        break;
+    case '\f':
+        shorthand = "\\f";
+        break;
+    case '\n':
+        shorthand = "\\n";
+        break;
+    case '\r':
+        shorthand = "\\r";
+        break;
+    case '\t':
+        shorthand = "\\t";
+        break;
+    default:
+        if (c >= 0x20)
+            return 0;
+        snprintf(out, 7, "\\u%04x", c);
+        return 6;
     }
+    memcpy(out, shorthand, 2);
+    return 2;
+}
+
+// Length of the UTF-8 sequence starting at i. When it is ill-formed, valid
+// is cleared and the length covers its longest well-formed prefix, at least
+// one byte, which is what a single U+FFFD replaces.
+static size_t utf8_length(std::string_view text, size_t i, bool& valid)
+{
+    auto byte = [&](size_t at) -> unsigned
+    { return at < text.size() ? (unsigned char)text[at] : 0; };
+    unsigned c = byte(i);
+    valid      = true;
+    if (c < 0x80)
+        return 1;
+    size_t   length;
+    unsigned low = 0x80, high = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF)
+        length = 2;
+    else if (c >= 0xE0 && c <= 0xEF)
+    {
+        length = 3;
+        if (c == 0xE0)
+            low = 0xA0;
+        else if (c == 0xED)
+            high = 0x9F;
+    }
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+        length = 4;
+        if (c == 0xF0)
+            low = 0x90;
+        else if (c == 0xF4)
+            high = 0x8F;
+    }
+    else
+        length = 1;
+    for (size_t k = 1; k < length; k++)
+    {
+        if (byte(i + k) < (k == 1 ? low : 0x80) ||
+            byte(i + k) > (k == 1 ? high : 0xBF))
+        {
+            valid = false;
+            return k;
+        }
+    }
+    valid = length > 1;
+    return length;
+}
+
+static const char REPLACEMENT_CHARACTER[] = "\xEF\xBF\xBD";
+
+// Writes the JSON form of the character at offset and steps past it. Bytes
+// that are not valid UTF-8 become U+FFFD, as nlohmann::json's replace handler
+// does, since the API rejects them.
+static size_t escape_at(std::string_view text, size_t& offset, char* out)
+{
+    unsigned char c = text[offset];
+    if (c < 0x80)
+    {
+        offset++;
+        return escape_json(c, out);
+    }
+    bool   valid;
+    size_t length = utf8_length(text, offset, valid);
+    if (!valid)
+    {
+        offset += length;
+        memcpy(out, REPLACEMENT_CHARACTER, 3);
+        return 3;
+    }
+    memcpy(out, text.data() + offset, length);
+    offset += length;
+    return length;
+}
+
+static size_t escaped_size(std::string_view text)
+{
+    char   scratch[7];
+    size_t size = 0;
+    for (size_t i = 0; i < text.size();)
+    {
+        unsigned char c = text[i];
+        if (c < 0x80 && !needs_escape(c))
+        {
+            size++;
+            i++;
+        }
+        else
+            size += escape_at(text, i, scratch);
+    }
+    return size;
+}
+
+// net::shared_bytes
+net::shared_bytes::shared_bytes(std::string bytes)
+{
+    auto owned = std::make_shared<const std::string>(std::move(bytes));
+    data_      = reinterpret_cast<const uint8_t*>(owned->data());
+    size_      = owned->size();
+    owner_     = std::move(owned);
+}
+
+net::shared_bytes::shared_bytes(std::vector<uint8_t> bytes)
+{
+    auto owned = std::make_shared<const std::vector<uint8_t>>(std::move(bytes));
+    data_      = owned->data();
+    size_      = owned->size();
+    owner_     = std::move(owned);
+}
+
+// net::body_piece
+net::body_piece net::body_piece::literal(std::string bytes)
+{
+    body_piece piece;
+    piece.size_  = bytes.size();
+    piece.owned_ = std::move(bytes);
+    return piece;
+}
+
+net::body_piece net::body_piece::shared(net::shared_bytes bytes)
+{
+    body_piece piece;
+    piece.view_   = bytes.view();
+    piece.size_   = bytes.size();
+    piece.shared_ = std::move(bytes);
+    return piece;
+}
+
+net::body_piece net::body_piece::span(const void* bytes, size_t size)
+{
+    body_piece piece;
+    piece.view_ = std::string_view(static_cast<const char*>(bytes), size);
+    piece.size_ = size;
+    return piece;
+}
+
+net::body_piece net::body_piece::escaped(std::string_view text)
+{
+    body_piece piece;
+    piece.kind_ = kind::ESCAPED;
+    piece.view_ = text;
+    piece.size_ = escaped_size(text);
+    return piece;
+}
+
+net::body_piece net::body_piece::file(const std::string& path, uint64_t offset,
+                                      uint64_t size, bool raw)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open '" + path +
+                                 "': " + strerror(errno));
+    struct stat st = {};
+    void*       addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    body_piece piece;
+    piece.kind_ = raw ? kind::BYTES : kind::ESCAPED;
+    if (addr != MAP_FAILED)
+    {
+        size_t length  = st.st_size;
+        piece.mapping_ = std::shared_ptr<const void>(
+            addr,
+            [length](const void* p) { munmap(const_cast<void*>(p), length); });
+        offset      = std::min<uint64_t>(offset, length);
+        size        = std::min<uint64_t>(size, length - offset);
+        piece.view_ = std::string_view(static_cast<const char*>(addr) + offset,
+                                       size);
+    }
+    else if (st.st_size > 0)
+        throw std::runtime_error("Failed to map '" + path +
+                                 "': " + strerror(errno));
+    piece.size_ = raw ? piece.view_.size() : escaped_size(piece.view_);
+    return piece;
+}
+
+net::body_piece net::body_piece::generated(producer fill, int64_t size)
+{
+    body_piece piece;
+    piece.kind_ = kind::GENERATED;
+    piece.fill_ = std::move(fill);
+    piece.size_ = size;
+    return piece;
+}
+
+int64_t net::body_size(const std::vector<net::body_piece>& pieces)
+{
+    int64_t total = 0;
+    for (const auto& piece : pieces)
+    {
+        if (piece.size() < 0)
+            return -1;
+        total += piece.size();
+    }
+    return total;
+}
+
+// net::body_reader
+size_t net::body_reader::read(uint8_t* out, size_t capacity)
+{
+    size_t written = 0;
+    while (written < capacity)
+    {
+        if (pending_at_ < pending_size_)
+        {
+            out[written++] = pending_[pending_at_++];
+            continue;
+        }
+        if (piece_ == pieces_->size())
+            break;
+
+        const body_piece& piece = (*pieces_)[piece_];
+        std::string_view  bytes =
+            piece.owned_.empty() ? piece.view_ : std::string_view(piece.owned_);
+        bool done = false;
+        if (piece.kind_ == body_piece::kind::GENERATED)
+        {
+            generated_  = true;
+            size_t made = piece.fill_(out + written, capacity - written);
+            written += made;
+            done = made == 0;
+        }
+        else if (piece.kind_ == body_piece::kind::BYTES)
+        {
+            size_t count = std::min(capacity - written, bytes.size() - offset_);
+            memcpy(out + written, bytes.data() + offset_, count);
+            written += count;
+            offset_ += count;
+        }
+        else
+        {
+            // Copy runs that need no escaping whole, stopping before a
+            // character that doesn't fit so it is never split
+            while (written < capacity && offset_ < bytes.size())
+            {
+                size_t run = offset_;
+                size_t end =
+                    std::min(bytes.size(), offset_ + capacity - written);
+                while (run < end)
+                {
+                    bool   valid  = !needs_escape(bytes[run]);
+                    size_t length = valid ? utf8_length(bytes, run, valid) : 1;
+                    if (!valid || run + length > end)
+                        break;
+                    run += length;
+                }
+                memcpy(out + written, bytes.data() + offset_, run - offset_);
+                written += run - offset_;
+                offset_ = run;
+                if (run < end)
+                {
+                    char escaped[7];
+                    pending_size_ = escape_at(bytes, offset_, escaped);
+                    memcpy(pending_, escaped, pending_size_);
+                    pending_at_ = 0;
+                    break;
+                }
+            }
+        }
+        if (done || (piece.kind_ != body_piece::kind::GENERATED &&
+                     offset_ == bytes.size()))
+        {
+            piece_++;
+            offset_ = 0;
+        }
+    }
+    bytes_read_ += written;
+    return written;
+}
+
+bool net::body_reader::rewind()
+{
+    if (generated_)
+        return false;
+    piece_        = 0;
+    offset_       = 0;
+    pending_at_   = 0;
+    pending_size_ = 0;
+    bytes_read_   = 0;
+    return true;
+}
+
+static size_t read_body_callback(char* buffer, size_t size, size_t nitems,
+                                 void* userp)
+{
+    try
+    {
+        return static_cast<net::body_reader*>(userp)->read(
+            reinterpret_cast<uint8_t*>(buffer), size * nitems);
+    }
+    catch (const std::exception&)
+    {
+        return CURL_READFUNC_ABORT;
+    }
+}
+
+static int seek_body_callback(void* userp, curl_off_t offset, int origin)
+{
+    if (offset != 0 || origin != SEEK_SET)
+        return CURL_SEEKFUNC_CANTSEEK;
+    return static_cast<net::body_reader*>(userp)->rewind()
+               ? CURL_SEEKFUNC_OK
+               : CURL_SEEKFUNC_CANTSEEK;
+}
+
+const char* net::content_encoding_name(net::content_encoding encoding)
+{
+    return encoding == content_encoding::GZIP ? "gzip" : "deflate";
+}
+
+// net::client
+static const net::url LOCALHOST("http://localhost");
+
+static std::once_flag curl_initialized;
+
+CURL* net::client::new_curl_handle()
+{
+    // Global init is not thread-safe, and curl_easy_init would otherwise do
+    // it unguarded for the first handle
+    std::call_once(curl_initialized,
+                   []()
+                   {
+                       curl_global_init(CURL_GLOBAL_ALL);
+                       atexit(curl_global_cleanup);
+                   });
+    return curl_easy_init();
 }
 
 net::client::client(net::url url_to_send_to)
     : default_url(std::move(url_to_send_to)),
       default_method(http_method::HTTP_METHOD_NULL),
-      curl_(curl_easy_init(), &curl_deleter), header_list_(nullptr)
+      curl_(new_curl_handle(), &curl_deleter)
 {
-    ensure_curl_initialized();
     if (!curl_)
     {
         throw std::runtime_error("CURL initialization failed");
     }
-    curl_easy_setopt(curl_.get(), CURLOPT_COOKIEFILE, "");
-    curl_easy_setopt(curl_.get(), CURLOPT_COOKIEJAR, "");
+    // Signals for DNS timeouts would land on whichever thread gets them
+    curl_easy_setopt(curl_.get(), CURLOPT_NOSIGNAL, 1L);
 }
 
-net::client::~client()
+net::client::~client() { curl_slist_free_all(default_header_list_); }
+
+void net::client::set_default_header(const std::string& name,
+                                     const std::string& value)
 {
-    if (header_list_ != nullptr)
+    auto found = default_headers_.find(name);
+    if (found != default_headers_.end() && found->second == value)
+        return;
+    default_headers_[name]   = value;
+    default_headers_changed_ = true;
+}
+
+void net::client::remove_default_header(const std::string& name)
+{
+    if (default_headers_.erase(name))
+        default_headers_changed_ = true;
+}
+
+bool net::client::is_default_header(const std::string& name) const
+{
+    for (const auto& header : default_headers_)
     {
-        curl_slist_free_all(header_list_);
+        if (strcasecmp(header.first.c_str(), name.c_str()) == 0)
+            return true;
     }
+    return false;
 }
 
 static void
@@ -107,7 +556,7 @@ void net::sse_dechunker_callback(const uint8_t* bytes, const size_t size,
         sse_dechunker* dechunker = static_cast<sse_dechunker*>(userp);
         std::string&   buffer    = dechunker->next_chunk;
         buffer.append(reinterpret_cast<const char*>(bytes), size);
-        static const std::string bom = "\xEF\xBB\xBF";
+        constexpr std::string_view bom = "\xEF\xBB\xBF";
         if (!dechunker->started && buffer.compare(0, bom.size(), bom) == 0)
             buffer.erase(0, bom.size());
 
@@ -187,29 +636,29 @@ void net::client::subscribe(net::write_callback callback, void* userp)
     default_subscriptions.emplace_back(callback, userp, false);
 }
 
-void net::client::set_default_string(const std::string& text_data)
+void net::client::set_default_string(std::string text_data)
 {
-    default_data.assign(text_data.begin(), text_data.end());
+    default_data = shared_bytes(std::move(text_data));
 }
 
-void net::client::set_default_data(const std::vector<uint8_t>& binary_data)
+void net::client::set_default_data(std::vector<uint8_t> binary_data)
 {
-    default_data = binary_data;
-    set_default_content_type(default_headers, "application/octet-stream");
+    default_data = shared_bytes(std::move(binary_data));
+    if (!is_default_header("Content-Type"))
+        set_default_header("Content-Type", "application/octet-stream");
 }
 
 void net::client::set_default_json(const nlohmann::json& json_data)
 {
-    std::string json_str = json_data.dump();
-    default_data.assign(json_str.begin(), json_str.end());
-    set_default_content_type(default_headers, "application/json");
+    default_data = shared_bytes(json_data.dump());
+    if (!is_default_header("Content-Type"))
+        set_default_header("Content-Type", "application/json");
 }
 
 struct write_callback_internal
 {
     net::response*                 response;
     std::vector<net::subscription> subscribers;
-    std::string                    raw_headers;
 };
 
 static void call_subscriber(net::subscription& subscription, void* contents,
@@ -224,8 +673,12 @@ size_t net::client::write_header_callback(void* contents, size_t size,
 {
     write_callback_internal* user_callback_data =
         static_cast<write_callback_internal*>(userp);
-    user_callback_data->raw_headers.append(static_cast<char*>(contents),
-                                           size * nmemb);
+    // Each call is one line. A status line starts the block of an interim,
+    // redirected or final response, and only the last block is kept.
+    std::string& raw_headers = user_callback_data->response->raw_headers;
+    if (size * nmemb >= 5 && memcmp(contents, "HTTP/", 5) == 0)
+        raw_headers.clear();
+    raw_headers.append(static_cast<char*>(contents), size * nmemb);
 
     for (auto& subscription : user_callback_data->subscribers)
     {
@@ -234,6 +687,14 @@ size_t net::client::write_header_callback(void* contents, size_t size,
     return size * nmemb;
 }
 
+// Called at least once a second while a transfer runs, so a cancel is
+// noticed even when nothing arrives.
+int net::client::progress_callback(void* userp, curl_off_t, curl_off_t,
+                                   curl_off_t, curl_off_t)
+{
+    return static_cast<const std::atomic<bool>*>(userp)->load() ? 1 : 0;
+}
+
 size_t net::client::write_data_callback(void* contents, size_t size,
                                         size_t nmemb, void* userp)
 {
@@ -250,39 +711,6 @@ size_t net::client::write_data_callback(void* contents, size_t size,
     return size * nmemb;
 }
 
-static void
-parse_raw_headers(const std::string&                            raw_headers,
-                  std::unordered_map<std::string, std::string>& headers,
-                  std::string&                                  status_line)
-{
-    std::istringstream stream(raw_headers);
-    std::string        line;
-    if (std::getline(stream, line))
-    {
-        status_line = net::trim_whitespace(line);
-    }
-
-    while (std::getline(stream, line))
-    {
-        line = net::trim_whitespace(line);
-
-        if (line.empty())
-            continue;
-
-        std::size_t colon_pos = line.find(':');
-        if (colon_pos == std::string::npos)
-            continue;
-
-        std::string key   = net::trim_whitespace(line.substr(0, colon_pos));
-        std::string value = net::trim_whitespace(line.substr(colon_pos + 1));
-
-        if (headers.find(key) != headers.end())
-            headers[key] += ", " + value;
-        else
-            headers[key] = value;
-    }
-}
-
 std::vector<std::string> net::client::get_cookies()
 {
     std::vector<std::string> cookies;
@@ -311,39 +739,85 @@ net::response net::client::send(const net::request& request)
 {
     net::response response;
 
-    net::url url_to_send_to;
+    const net::url* target = &request.req_url;
+    if (target->get_domain().empty())
+        target = default_url.get_domain().empty() ? &LOCALHOST : &default_url;
 
-    if (!request.req_url.domain.empty())
-        url_to_send_to = request.req_url;
-    else if (!default_url.domain.empty())
-        url_to_send_to = default_url;
+    // The query is the default parameters overridden by the request's, which
+    // the target already has unless the other url adds some
+    const auto& default_query = default_url.get_query_parameters();
+    const auto& request_query = request.req_url.get_query_parameters();
+    if ((target != &default_url && !default_query.empty()) ||
+        (target != &request.req_url && !request_query.empty()))
+    {
+        std::map<std::string, std::string> query = default_query;
+        for (const auto& param : request_query)
+            query[param.first] = param.second;
+        net::url with_query = *target;
+        with_query.set_query_parameters(std::move(query));
+        curl_easy_setopt(curl_.get(), CURLOPT_URL,
+                         with_query.to_string().c_str());
+    }
     else
-        url_to_send_to = net::url("http://localhost");
-
-    for (const auto& param : default_url.query_parameters)
-        url_to_send_to.query_parameters[param.first] = param.second;
-
-    for (const auto& param : request.req_url.query_parameters)
-        url_to_send_to.query_parameters[param.first] = param.second;
-
-    curl_easy_setopt(curl_.get(), CURLOPT_URL,
-                     url_to_send_to.to_string().c_str());
+    {
+        curl_easy_setopt(curl_.get(), CURLOPT_URL, target->to_string().c_str());
+    }
     curl_easy_setopt(curl_.get(), CURLOPT_FOLLOWLOCATION,
                      follow_redirects ? 1L : 0L);
-
-    if (!request.data.empty())
+    curl_easy_setopt(curl_.get(), CURLOPT_TIMEOUT_MS, timeout_ms);
+    curl_easy_setopt(curl_.get(), CURLOPT_NOPROGRESS, cancel ? 0L : 1L);
+    curl_easy_setopt(curl_.get(), CURLOPT_XFERINFOFUNCTION,
+                     cancel ? progress_callback : nullptr);
+    curl_easy_setopt(curl_.get(), CURLOPT_XFERINFODATA, cancel);
+
+    const shared_bytes& body =
+        !request.data.empty() ? request.data : default_data;
+    std::unique_ptr<body_reader> reader;
+    int64_t                      body_bytes = body.size();
+    if (!request.pieces.empty())
     {
-        curl_easy_setopt(curl_.get(), CURLOPT_POSTFIELDS, request.data.data());
-        curl_easy_setopt(curl_.get(), CURLOPT_POSTFIELDSIZE,
-                         request.data.size());
+        reader     = std::make_unique<body_reader>(request.pieces);
+        body_bytes = body_size(request.pieces);
     }
-    else if (!default_data.empty())
+    shared_bytes compressed;
+    bool         compress_body =
+        compress_threshold &&
+        (body_bytes < 0 || (uint64_t)body_bytes >= compress_threshold) &&
+        request.headers.find("Content-Encoding") == request.headers.end() &&
+        !is_default_header("Content-Encoding");
+    if (compress_body && reader)
     {
-        curl_easy_setopt(curl_.get(), CURLOPT_POSTFIELDS, default_data.data());
+        compressed = shared_bytes(::compress(*reader, request_encoding));
+        body_bytes = reader->bytes_read();
+        reader.reset();
+    }
+    else if (compress_body)
+        compressed = shared_bytes(
+            compress(body.data(), body.size(), request_encoding));
+    const shared_bytes& wire_body = compress_body ? compressed : body;
+    if (reader)
+    {
+        // Without post fields curl pulls the body from the read callback,
+        // chunked when its size is unknown
+        curl_easy_setopt(curl_.get(), CURLOPT_POSTFIELDS, nullptr);
+        curl_easy_setopt(curl_.get(), CURLOPT_POSTFIELDSIZE_LARGE,
+                         (curl_off_t)body_bytes);
+        curl_easy_setopt(curl_.get(), CURLOPT_READFUNCTION, read_body_callback);
+        curl_easy_setopt(curl_.get(), CURLOPT_READDATA, reader.get());
+        curl_easy_setopt(curl_.get(), CURLOPT_SEEKFUNCTION, seek_body_callback);
+        curl_easy_setopt(curl_.get(), CURLOPT_SEEKDATA, reader.get());
+    }
+    else if (!wire_body.empty())
+    {
+        curl_easy_setopt(curl_.get(), CURLOPT_POSTFIELDS, wire_body.data());
         curl_easy_setopt(curl_.get(), CURLOPT_POSTFIELDSIZE,
-                         default_data.size());
+                         (long)wire_body.size());
     }
 
+    // An empty string offers every encoding this curl was built with
+    curl_easy_setopt(curl_.get(), CURLOPT_ACCEPT_ENCODING,
+                     accept_compressed ? "" : nullptr);
+
     net::http_method method_to_use =
         request.method != net::http_method::HTTP_METHOD_NULL ? request.method
                                                              : default_method;
@@ -362,30 +836,57 @@ net::response net::client::send(const net::request& request)
                          http_method_to_string(method_to_use).c_str());
     }
 
-    std::unordered_map<std::string, std::string> headers_to_send;
-
-    for (const auto& header : default_headers)
-        headers_to_send[header.first] = header.second;
-
-    for (const auto& header : request.headers)
-        headers_to_send[header.first] = header.second;
-
-    if (header_list_ != nullptr)
+    if (default_headers_changed_)
     {
-        curl_slist_free_all(header_list_);
-        header_list_ = nullptr;
+        curl_slist_free_all(default_header_list_);
+        default_header_list_ = nullptr;
+        for (const auto& header : default_headers_)
+            default_header_list_ = curl_slist_append(
+                default_header_list_,
+                (header.first + ": " + header.second).c_str());
+        default_headers_changed_ = false;
     }
 
-    if (!headers_to_send.empty())
+    // The request's own headers go in front of the cached defaults. Only
+    // when one replaces a default are the other defaults copied instead.
+    struct curl_slist* request_headers = nullptr;
+    struct curl_slist* last_header     = nullptr;
+    bool               replaces_default = false;
+    auto               add_header =
+        [&](const std::string& name, const std::string& value)
+    {
+        struct curl_slist* added = curl_slist_append(
+            last_header, (name + ": " + value).c_str());
+        if (!request_headers)
+            request_headers = added;
+        last_header = last_header ? last_header->next : added;
+        replaces_default |= is_default_header(name);
+    };
+    for (const auto& header : request.headers)
+        add_header(header.first, header.second);
+    if (compress_body)
+        add_header("Content-Encoding", content_encoding_name(request_encoding));
+    if (replaces_default)
     {
-        for (const auto& header : headers_to_send)
+        for (const auto& header : default_headers_)
         {
-            std::string header_string = header.first + ": " + header.second;
-            header_list_ =
-                curl_slist_append(header_list_, header_string.c_str());
-            curl_easy_setopt(curl_.get(), CURLOPT_HTTPHEADER, header_list_);
+            bool replaced = false;
+            for (const auto& own : request.headers)
+                replaced |= strcasecmp(own.first.c_str(),
+                                       header.first.c_str()) == 0;
+            if (compress_body)
+                replaced |= strcasecmp(header.first.c_str(),
+                                       "Content-Encoding") == 0;
+            if (!replaced)
+                add_header(header.first, header.second);
         }
     }
+    else if (last_header)
+    {
+        last_header->next = default_header_list_;
+    }
+    curl_easy_setopt(curl_.get(), CURLOPT_HTTPHEADER,
+                     request_headers ? request_headers : default_header_list_);
 
     std::vector<net::subscription> subscriptions{};
     subscriptions.reserve(default_subscriptions.size() +
@@ -395,7 +896,7 @@ net::response net::client::send(const net::request& request)
     subscriptions.insert(subscriptions.end(), request.subscriptions.begin(),
                          request.subscriptions.end());
 
-    write_callback_internal callback_data = {&response, subscriptions, {}};
+    write_callback_internal callback_data = {&response, subscriptions};
 
     curl_easy_setopt(curl_.get(), CURLOPT_WRITEFUNCTION, write_data_callback);
     curl_easy_setopt(curl_.get(), CURLOPT_WRITEDATA, &callback_data);
@@ -404,62 +905,145 @@ net::response net::client::send(const net::request& request)
                      write_header_callback);
     curl_easy_setopt(curl_.get(), CURLOPT_HEADERDATA, &callback_data);
 
-    curl_easy_setopt(curl_.get(), CURLOPT_COOKIEFILE, cookie_file.c_str());
-    curl_easy_setopt(curl_.get(), CURLOPT_COOKIEJAR, cookie_file.c_str());
+    if (keep_cookies || !cookie_file.empty())
+    {
+        curl_easy_setopt(curl_.get(), CURLOPT_COOKIEFILE, cookie_file.c_str());
+        curl_easy_setopt(curl_.get(), CURLOPT_COOKIEJAR, cookie_file.c_str());
+    }
 
     response.curl_code = curl_easy_perform(curl_.get());
+    if (last_header && !replaces_default)
+        last_header->next = nullptr;
+    curl_slist_free_all(request_headers);
+    if (reader)
+    {
+        response.request_size = response.request_wire_size =
+            reader->bytes_read();
+        curl_easy_setopt(curl_.get(), CURLOPT_READFUNCTION, nullptr);
+        curl_easy_setopt(curl_.get(), CURLOPT_READDATA, nullptr);
+        curl_easy_setopt(curl_.get(), CURLOPT_SEEKFUNCTION, nullptr);
+        curl_easy_setopt(curl_.get(), CURLOPT_SEEKDATA, nullptr);
+        // Left without post fields, the next bodiless POST would fall back to
+        // fread on the null READDATA
+        curl_easy_setopt(curl_.get(), CURLOPT_POSTFIELDS, "");
+        curl_easy_setopt(curl_.get(), CURLOPT_POSTFIELDSIZE, 0L);
+    }
+    else
+    {
+        response.request_size      = body_bytes;
+        response.request_wire_size = wire_body.size();
+    }
     if (response.curl_code == CURLE_OK)
     {
         long http_code = 0;
         curl_easy_getinfo(curl_.get(), CURLINFO_RESPONSE_CODE, &http_code);
         response.response_code = static_cast<int>(http_code);
+        curl_off_t received    = 0;
+        curl_easy_getinfo(curl_.get(), CURLINFO_SIZE_DOWNLOAD_T, &received);
+        response.body_wire_size = received;
     }
 
-    parse_raw_headers(callback_data.raw_headers, response.headers,
-                      response.status_line);
+    const std::string& raw = response.raw_headers;
+    size_t             end = raw.find_first_of("\r\n");
+    response.status_line   = raw.substr(0, end);
     return response;
 }
 
-// net::url
-net::url::url(const std::string& url_string) { parse(url_string); }
+// net::response
+static bool is_blank(char c) { return c == ' ' || c == '\t'; }
 
-net::url::url(const net::url& other)
-    : protocol(other.protocol), domain(other.domain), port(other.port),
-      path(other.path), query_parameters(other.query_parameters)
+const std::vector<net::response::header_field>&
+net::response::header_index() const
 {
+    if (header_indexed_)
+        return header_index_;
+    header_indexed_ = true;
+    header_index_.clear();
+
+    // Skips the status line, then records name and trimmed value of each
+    // "Name: value" line
+    size_t line = raw_headers.find('\n');
+    while (line != std::string::npos && ++line < raw_headers.size())
+    {
+        size_t end = raw_headers.find('\n', line);
+        if (end == std::string::npos)
+            end = raw_headers.size();
+        size_t colon = raw_headers.find(':', line);
+        if (colon < end && colon > line)
+        {
+            size_t name_end    = colon;
+            size_t value_begin = colon + 1, value_end = end;
+            while (name_end > line && is_blank(raw_headers[name_end - 1]))
+                name_end--;
+            while (value_begin < value_end &&
+                   is_blank(raw_headers[value_begin]))
+                value_begin++;
+            while (value_end > value_begin &&
+                   (is_blank(raw_headers[value_end - 1]) ||
+                    raw_headers[value_end - 1] == '\r'))
+                value_end--;
+            header_index_.push_back(
+                {(uint32_t)line, (uint32_t)(name_end - line),
+                 (uint32_t)value_begin, (uint32_t)(value_end - value_begin)});
+        }
+        line = end;
+    }
+    return header_index_;
 }
 
-net::url::url(net::url&& other) noexcept
-    : protocol(std::move(other.protocol)), domain(std::move(other.domain)),
-      port(std::move(other.port)), path(std::move(other.path)),
-      query_parameters(std::move(other.query_parameters))
+std::string_view net::response::header(std::string_view name) const
 {
+    for (const auto& field : header_index())
+    {
+        if (field.name_size == name.size() &&
+            strncasecmp(raw_headers.data() + field.name_offset, name.data(),
+                        name.size()) == 0)
+            return {raw_headers.data() + field.value_offset, field.value_size};
+    }
+    return {};
 }
 
-net::url& net::url::operator=(const net::url& other)
+std::vector<std::string_view>
+net::response::header_values(std::string_view name) const
 {
-    if (this != &other)
+    std::vector<std::string_view> values;
+    for (const auto& field : header_index())
     {
-        protocol         = other.protocol;
-        domain           = other.domain;
-        port             = other.port;
-        path             = other.path;
-        query_parameters = other.query_parameters;
+        if (field.name_size == name.size() &&
+            strncasecmp(raw_headers.data() + field.name_offset, name.data(),
+                        name.size()) == 0)
+            values.emplace_back(raw_headers.data() + field.value_offset,
+                                field.value_size);
     }
-    return *this;
+    return values;
 }
 
-net::url& net::url::operator=(net::url&& other) noexcept
+size_t net::response::header_count() const { return header_index().size(); }
+
+// net::url
+net::url::url(const std::string& url_string)
 {
-    if (this != &other)
-    {
-        protocol         = std::move(other.protocol);
-        domain           = std::move(other.domain);
-        port             = std::move(other.port);
-        path             = std::move(other.path);
-        query_parameters = std::move(other.query_parameters);
-    }
-    return *this;
+    parse(url_string);
+    serialize();
+}
+
+void net::url::set_path(std::string path)
+{
+    path_ = std::move(path);
+    serialize();
+}
+
+void net::url::set_query_parameter(const std::string& key, std::string value)
+{
+    query_parameters_[key] = std::move(value);
+    serialize();
+}
+
+void net::url::set_query_parameters(
+    std::map<std::string, std::string> parameters)
+{
+    query_parameters_ = std::move(parameters);
+    serialize();
 }
 
 void net::url::parse(const std::string& url_string)
@@ -471,28 +1055,28 @@ void net::url::parse(const std::string& url_string)
     if (protocol_end != end && (protocol_end + 1) != end &&
         *(protocol_end + 1) == '/' && *(protocol_end + 2) == '/')
     {
-        protocol = std::string(it, protocol_end);
-        it       = protocol_end + 3;
+        protocol_ = std::string(it, protocol_end);
+        it        = protocol_end + 3;
     }
     else
     {
-        protocol = "http";
+        protocol_ = "http";
     }
 
     auto domain_end = std::find(it, end, '/');
     auto port_start = std::find(it, domain_end, ':');
     if (port_start != domain_end)
     {
-        domain = std::string(it, port_start);
-        port   = std::string(port_start + 1, domain_end);
+        domain_ = std::string(it, port_start);
+        port_   = std::string(port_start + 1, domain_end);
     }
     else
     {
-        domain = std::string(it, domain_end);
+        domain_ = std::string(it, domain_end);
         set_default_port();
     }
 
-    if (domain.empty())
+    if (domain_.empty())
     {
         throw std::invalid_argument("URL is missing a domain");
     }
@@ -500,123 +1084,136 @@ void net::url::parse(const std::string& url_string)
     it = domain_end;
 
     auto path_end = std::find(it, end, '?');
-    path          = std::string(it, path_end);
+    path_         = std::string(it, path_end);
     it            = path_end;
 
     if (it != end && *it == '?')
     {
         ++it;
-        parse_query_string(std::string(it, end));
+        parse_query_string(std::string_view(&*it, end - it));
     }
 }
 
 void net::url::set_default_port()
 {
-    if (protocol == "http")
-        port = "80";
-    else if (protocol == "https")
-        port = "443";
-    else if (protocol == "ftp")
-        port = "21";
-    else if (protocol == "sftp")
-        port = "22";
+    if (protocol_ == "http")
+        port_ = "80";
+    else if (protocol_ == "https")
+        port_ = "443";
+    else if (protocol_ == "ftp")
+        port_ = "21";
+    else if (protocol_ == "sftp")
+        port_ = "22";
     else
-        port.erase();
+        port_.erase();
 }
 
-std::string net::url::encode(const std::string& str)
+// RFC 3986 unreserved characters pass through, the same set curl leaves
+// alone, and every other byte becomes %XX.
+static constexpr std::array<bool, 256> make_unreserved_table()
 {
-    static CURL* curl = nullptr;
-    if (!curl)
-    {
-        curl = curl_easy_init();
-        atexit(
-            []()
-            {
-                if (curl)
-                    curl_easy_cleanup(curl);
-            });
-    }
-    char*       encoded = curl_easy_escape(curl, str.c_str(), str.length());
-    std::string result  = encoded ? std::string(encoded) : "";
-    if (encoded)
-        curl_free(encoded);
-    return result;
+    std::array<bool, 256> table = {};
+    for (int c = 0; c < 256; c++)
+        table[c] = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+                   (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+                   c == '_' || c == '~';
+    return table;
 }
 
-std::string net::url::decode(const std::string& str)
+static constexpr std::array<int8_t, 256> make_hex_table()
 {
-    static CURL* curl = nullptr;
-    if (!curl)
+    std::array<int8_t, 256> table = {};
+    for (int c = 0; c < 256; c++)
+        table[c] = c >= '0' && c <= '9'   ? c - '0'
+                   : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                   : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                          : -1;
+    return table;
+}
+
+static constexpr std::array<bool, 256>   UNRESERVED = make_unreserved_table();
+static constexpr std::array<int8_t, 256> HEX_VALUE  = make_hex_table();
+static constexpr char                    HEX_DIGIT[] = "0123456789ABCDEF";
+
+std::string net::url::encode(std::string_view str)
+{
+    std::string result;
+    result.reserve(str.size());
+    for (unsigned char c : str)
     {
-        curl = curl_easy_init();
-        atexit(
-            []()
-            {
-                if (curl)
-                    curl_easy_cleanup(curl);
-            });
-    }
-    int   outlength;
-    char* decoded =
-        curl_easy_unescape(curl, str.c_str(), str.length(), &outlength);
-    std::string result = decoded ? std::string(decoded, outlength) : "";
-    if (decoded)
-        curl_free(decoded);
+        if (UNRESERVED[c])
+        {
+            result += c;
+            continue;
+        }
+        result += '%';
+        result += HEX_DIGIT[c >> 4];
+        result += HEX_DIGIT[c & 15];
+    }
     return result;
 }
 
-void net::url::parse_query_string(const std::string& query)
+std::string net::url::decode(std::string_view str)
 {
-    std::istringstream query_stream(query);
-    std::string        pair;
-    while (std::getline(query_stream, pair, '&'))
+    std::string result;
+    result.reserve(str.size());
+    for (size_t i = 0; i < str.size(); i++)
     {
-        auto equal_pos = pair.find('=');
-        if (equal_pos != std::string::npos)
+        if (str[i] == '%' && i + 2 < str.size() &&
+            HEX_VALUE[(unsigned char)str[i + 1]] >= 0 &&
+            HEX_VALUE[(unsigned char)str[i + 2]] >= 0)
         {
-            std::string key       = decode(pair.substr(0, equal_pos));
-            std::string value     = decode(pair.substr(equal_pos + 1));
-            query_parameters[key] = value;
+            result += (char)(HEX_VALUE[(unsigned char)str[i + 1]] << 4 |
+                             HEX_VALUE[(unsigned char)str[i + 2]]);
+            i += 2;
         }
         else
         {
-            query_parameters[decode(pair)] = "";
+            result += str[i];
         }
     }
+    return result;
 }
 
-std::string net::url::to_string() const
+void net::url::parse_query_string(std::string_view query)
 {
-    std::ostringstream oss;
-    oss << protocol << "://" << domain;
-    if (!((protocol == "http" && port == "80") ||
-          (protocol == "https" && port == "443")))
-        oss << ":" << port;
+    while (!query.empty())
+    {
+        size_t           amp  = query.find('&');
+        std::string_view pair = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view()
+                                              : query.substr(amp + 1);
+        if (pair.empty())
+            continue;
+        size_t equal_pos = pair.find('=');
+        if (equal_pos != std::string_view::npos)
+            query_parameters_[decode(pair.substr(0, equal_pos))] =
+                decode(pair.substr(equal_pos + 1));
+        else
+            query_parameters_[decode(pair)] = "";
+    }
+}
 
-    if (path.empty())
-        oss << '/';
-    else if (path[0] != '/')
-        oss << '/' << path;
-    else
-        oss << path;
+void net::url::serialize()
+{
+    serialized_ = protocol_ + "://" + domain_;
+    if (!((protocol_ == "http" && port_ == "80") ||
+          (protocol_ == "https" && port_ == "443")))
+        serialized_ += ":" + port_;
 
-    if (!query_parameters.empty())
+    if (path_.empty() || path_[0] != '/')
+        serialized_ += '/';
+    serialized_ += path_;
+
+    char separator = '?';
+    for (const auto& param : query_parameters_)
     {
-        oss << "?";
-        bool first = true;
-        for (const auto& param : query_parameters)
-        {
-            if (!first)
-            {
-                oss << "&";
-            }
-            oss << encode(param.first) << "=" << encode(param.second);
-            first = false;
-        }
+        serialized_ += separator;
+        serialized_ += encode(param.first);
+        serialized_ += '=';
+        serialized_ += encode(param.second);
+        separator = '&';
     }
-
-    return oss.str();
 }
 
 // net::request
@@ -672,21 +1269,34 @@ void net::request::subscribe(net::write_callback callback, void* userp)
     subscriptions.emplace_back(callback, userp, false);
 }
 
-void net::request::set_string(const std::string& text_data)
+void net::request::set_pieces(std::vector<net::body_piece> parts,
+                              const std::string&           content_type)
+{
+    pieces = std::move(parts);
+    set_default_content_type(headers, content_type);
+}
+
+void net::request::set_string(std::string text_data)
 {
-    data.assign(text_data.begin(), text_data.end());
+    data = shared_bytes(std::move(text_data));
 }
 
-void net::request::set_data(const std::vector<uint8_t>& binary_data)
+void net::request::set_data(std::vector<uint8_t> binary_data)
 {
-    data = binary_data;
+    data = shared_bytes(std::move(binary_data));
     set_default_content_type(headers, "application/octet-stream");
 }
 
+void net::request::set_data(net::shared_bytes bytes,
+                            const std::string& content_type)
+{
+    data = std::move(bytes);
+    set_default_content_type(headers, content_type);
+}
+
 void net::request::set_json(const nlohmann::json& json_data)
 {
-    std::string json_str = json_data.dump();
-    data.assign(json_str.begin(), json_str.end());
+    data = shared_bytes(json_data.dump());
     set_default_content_type(headers, "application/json");
 }
 
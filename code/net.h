@@ -1,10 +1,14 @@
 #ifndef LJ_NET
 #define LJ_NET
 
+#include <atomic>
 #include <cstdint>
 #include <vector>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <functional>
+#include <map>
 #include <unordered_map>
 #include <nlohmann/json.hpp>
 #include <curl/curl.h>
@@ -32,21 +36,34 @@ class url
 public:
     url() = default;
     explicit url(const std::string& url_string);
-    url(const url& other);
-    url(url&& other) noexcept;
-    url& operator=(const url& other);
-    url& operator=(url&& other) noexcept;
 
-    std::string                                  protocol, domain, port, path;
-    std::unordered_map<std::string, std::string> query_parameters;
-    std::string                                  to_string() const;
-    static std::string                           encode(const std::string& str);
-    static std::string                           decode(const std::string& str);
+    const std::string& get_protocol() const { return protocol_; }
+    const std::string& get_domain() const { return domain_; }
+    const std::string& get_port() const { return port_; }
+    const std::string& get_path() const { return path_; }
+    // Sorted, so the same parameters always serialize the same way
+    const std::map<std::string, std::string>& get_query_parameters() const
+    {
+        return query_parameters_;
+    }
+    void set_path(std::string path);
+    void set_query_parameter(const std::string& key, std::string value);
+    void set_query_parameters(std::map<std::string, std::string> parameters);
+
+    // Serialized whenever the url changes, not on every call
+    const std::string& to_string() const { return serialized_; }
+    static std::string encode(std::string_view str);
+    static std::string decode(std::string_view str);
 
 private:
     void parse(const std::string& url_string);
-    void parse_query_string(const std::string& query);
+    void parse_query_string(std::string_view query);
     void set_default_port();
+    void serialize();
+
+    std::string                        protocol_, domain_, port_, path_;
+    std::map<std::string, std::string> query_parameters_;
+    std::string                        serialized_;
 };
 
 enum class http_method
@@ -63,6 +80,17 @@ enum class http_method
     CONNECT
 };
 
+enum class content_encoding
+{
+    GZIP,
+    DEFLATE
+};
+
+// Compresses a body for a Content-Encoding of gzip or deflate (zlib).
+std::vector<uint8_t> compress(const uint8_t* bytes, size_t size,
+                              content_encoding encoding);
+const char*          content_encoding_name(content_encoding encoding);
+
 using write_callback = void (*)(const uint8_t*, size_t, void*, bool);
 
 struct subscription
@@ -77,17 +105,130 @@ struct subscription
 
 struct response
 {
-    int                                          response_code = 0;
-    std::string                                  status_line;
-    std::unordered_map<std::string, std::string> headers;
-    std::vector<uint8_t>                         body;
+    int         response_code = 0;
+    std::string status_line;
+    // The final response's header block as received, status line first
+    std::string                                  raw_headers;
+    std::vector<uint8_t>                         body; // Decoded
+    // Body sizes before and after content encoding
+    size_t                                       request_size      = 0;
+    size_t                                       request_wire_size = 0;
+    size_t                                       body_wire_size    = 0;
     std::string                                  to_string() const
     {
         return std::string(body.begin(), body.end());
     }
     CURLcode curl_code = CURLE_OK;
+
+    // The first value of the named header, matched in any case, or empty.
+    // Views point into raw_headers.
+    std::string_view              header(std::string_view name) const;
+    std::vector<std::string_view> header_values(std::string_view name) const;
+    size_t                        header_count() const;
+
+private:
+    // Offsets rather than views, so copies of a response stay valid
+    struct header_field
+    {
+        uint32_t name_offset, name_size, value_offset, value_size;
+    };
+    const std::vector<header_field>& header_index() const;
+
+    mutable std::vector<header_field> header_index_;
+    mutable bool                      header_indexed_ = false;
+};
+
+// Immutable bytes shared by reference count, so a body can go to several
+// transfers and caches without copies. Strings and vectors are moved in.
+class shared_bytes
+{
+public:
+    shared_bytes() = default;
+    explicit shared_bytes(std::string bytes);
+    explicit shared_bytes(std::vector<uint8_t> bytes);
+
+    const uint8_t*   data() const { return data_; }
+    size_t           size() const { return size_; }
+    bool             empty() const { return size_ == 0; }
+    std::string_view view() const
+    {
+        return {reinterpret_cast<const char*>(data_), size_};
+    }
+
+private:
+    std::shared_ptr<const void> owner_;
+    const uint8_t*              data_ = nullptr;
+    size_t                      size_ = 0;
 };
 
+// One part of a request body. A body of pieces is uploaded in order through
+// curl's read callback, so it is never joined into one buffer.
+class body_piece
+{
+public:
+    // Fills up to the given size and returns how much it wrote, 0 at the end.
+    using producer = std::function<size_t(uint8_t*, size_t)>;
+
+    static body_piece literal(std::string bytes);
+    static body_piece shared(shared_bytes bytes);
+    // Borrowed, so the bytes must outlive the send.
+    static body_piece span(const void* bytes, size_t size);
+    // Borrowed text written as the inside of a JSON string, with bytes that
+    // are not valid UTF-8 replaced by U+FFFD.
+    static body_piece escaped(std::string_view text);
+    // A mapped region of a file, JSON-escaped unless raw is set.
+    static body_piece file(const std::string& path, uint64_t offset = 0,
+                           uint64_t size = UINT64_MAX, bool raw = false);
+    // size is -1 when unknown, which makes the upload chunked.
+    static body_piece generated(producer fill, int64_t size = -1);
+
+    int64_t size() const { return size_; }
+
+private:
+    friend class body_reader;
+    enum class kind
+    {
+        BYTES,
+        ESCAPED,
+        GENERATED
+    };
+
+    kind                        kind_ = kind::BYTES;
+    std::string                 owned_;
+    std::string_view            view_;
+    shared_bytes                shared_;
+    std::shared_ptr<const void> mapping_;
+    producer                    fill_;
+    int64_t                     size_ = 0;
+};
+
+// Reads a body of pieces back to back, escaping as it goes.
+class body_reader
+{
+public:
+    explicit body_reader(const std::vector<body_piece>& pieces)
+        : pieces_(&pieces)
+    {
+    }
+
+    size_t read(uint8_t* out, size_t capacity);
+    // False once a generated piece has been read from.
+    bool     rewind();
+    uint64_t bytes_read() const { return bytes_read_; }
+
+private:
+    const std::vector<body_piece>* pieces_;
+    size_t                         piece_  = 0;
+    size_t                         offset_ = 0; // Into the current piece
+    char                           pending_[6];
+    uint8_t                        pending_at_ = 0, pending_size_ = 0;
+    uint64_t                       bytes_read_ = 0;
+    bool                           generated_  = false;
+};
+
+// Body size, or -1 when a generated piece doesn't know its size.
+int64_t body_size(const std::vector<body_piece>& pieces);
+
 struct request
 {
     explicit request(const url& req_url);
@@ -108,34 +249,64 @@ struct request
     url         req_url;
     http_method method = http_method::HTTP_METHOD_NULL;
     std::unordered_map<std::string, std::string> headers;
-    std::vector<uint8_t>                         data;
+    shared_bytes                                 data;
+    std::vector<body_piece>                      pieces; // Used over data
     std::vector<subscription>                    subscriptions;
     void     subscribe(write_callback callback, void* userp);
-    void     set_string(const std::string& text_data);
-    void     set_data(const std::vector<uint8_t>& binary_data);
+    void     set_pieces(std::vector<body_piece> parts,
+                        const std::string&      content_type);
+    void     set_string(std::string text_data);
+    void     set_data(std::vector<uint8_t> binary_data);
+    void     set_data(shared_bytes bytes, const std::string& content_type);
     void     set_json(const nlohmann::json& json_data);
     response send();
 };
 
+// Owns one curl handle and its connections. A client serves one thread at a
+// time; threads sending at once each keep their own.
 class client
 {
 public:
     explicit client(url url_to_send_to = {});
+    client(const client&)            = delete;
+    client& operator=(const client&) = delete;
     ~client();
 
     response send(const request& request);
 
-    url         default_url;
+    url                                          default_url;
     http_method default_method = http_method::HTTP_METHOD_NULL;
-    std::unordered_map<std::string, std::string> default_headers;
-    std::vector<uint8_t>                         default_data;
+    shared_bytes                                 default_data;
     std::vector<subscription>                    default_subscriptions;
     std::string                                  cookie_file;
+    // The cookie engine is only started when cookies are kept or a cookie
+    // file is given, sparing one-shot requests its setup.
+    bool                                         keep_cookies = false;
     bool                                         follow_redirects = false;
+    // Responses may come in any encoding curl can decode
+    bool                                         accept_compressed = true;
+    // Request bodies of at least this many bytes go out compressed, for
+    // servers that accept it. 0 never compresses.
+    size_t                                       compress_threshold = 0;
+    content_encoding                             request_encoding =
+        content_encoding::GZIP;
+    // Longest a whole transfer may take in milliseconds, 0 for no limit
+    long                                         timeout_ms = 0;
+    // A transfer in progress gives up soon after this is set, failing with
+    // CURLE_ABORTED_BY_CALLBACK
+    const std::atomic<bool>*                     cancel = nullptr;
 
     void subscribe(write_callback callback, void* userp);
-    void set_default_string(const std::string& text_data);
-    void set_default_data(const std::vector<uint8_t>& binary_data);
+    // Headers sent with every request unless a request sets the same name.
+    void set_default_header(const std::string& name, const std::string& value);
+    void remove_default_header(const std::string& name);
+    const std::unordered_map<std::string, std::string>& get_default_headers()
+        const
+    {
+        return default_headers_;
+    }
+    void set_default_string(std::string text_data);
+    void set_default_data(std::vector<uint8_t> binary_data);
     void set_default_json(const nlohmann::json& json_data);
     std::vector<std::string> get_cookies();
     void                     set_cookie(const std::string& cookie);
@@ -145,12 +316,20 @@ private:
     static void curl_deleter(CURL* curl) { curl_easy_cleanup(curl); }
     std::unique_ptr<CURL, decltype(&curl_deleter)> curl_{nullptr,
                                                          &curl_deleter};
-    static void                                    ensure_curl_initialized();
+    static CURL*                                   new_curl_handle();
     static size_t write_data_callback(void* contents, size_t size, size_t nmemb,
                                       void* userp);
     static size_t write_header_callback(void* contents, size_t size,
                                         size_t nmemb, void* userp);
-    struct curl_slist* header_list_ = nullptr;
+    static int    progress_callback(void* userp, curl_off_t, curl_off_t,
+                                    curl_off_t, curl_off_t);
+    bool              is_default_header(const std::string& name) const;
+
+    std::unordered_map<std::string, std::string> default_headers_;
+    // Built from default_headers_ when first needed after a change. Request
+    // headers are prepended to it for one send.
+    struct curl_slist* default_header_list_ = nullptr;
+    bool               default_headers_changed_ = false;
 };
 
 } // namespace net
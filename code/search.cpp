@@ -0,0 +1,421 @@
+#include "search.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <nlohmann/json.hpp>
+#include <sys/stat.h>
+
+// The index file is these records back to back: the header, then the
+// files, exchanges, terms (sorted), postings (grouped by term, sorted by
+// exchange) and finally the string bytes the files, snippets and terms point
+// into. File paths are relative to the indexed directory.
+namespace
+{
+const char MAGIC[8] = {'J', 'P', 'I', 'D', 'X', '0', '0', '2'};
+
+struct file_header
+{
+    char     magic[8];
+    uint32_t file_count, doc_count, term_count, posting_count;
+    uint64_t strings_size;
+};
+
+struct file_entry
+{
+    int64_t  mtime_sec, mtime_nsec;
+    uint64_t size;
+    uint32_t path_offset, path_size;
+};
+
+struct doc_entry
+{
+    uint32_t file, exchange, snippet_offset, snippet_size;
+};
+
+struct term_entry
+{
+    uint32_t text_offset, text_size, first_posting, posting_count;
+};
+
+struct posting
+{
+    uint32_t doc, count;
+};
+
+size_t expected_size(const file_header& header)
+{
+    // Keeps a huge strings_size from wrapping the sum round to a valid size
+    if (header.strings_size > SIZE_MAX / 2)
+        return 0;
+    return sizeof(header) + header.file_count * sizeof(file_entry) +
+           header.doc_count * sizeof(doc_entry) +
+           header.term_count * sizeof(term_entry) +
+           header.posting_count * sizeof(posting) + header.strings_size;
+}
+
+template <typename T> T record(const uint8_t* section, size_t i)
+{
+    T value;
+    memcpy(&value, section + i * sizeof(T), sizeof(T));
+    return value;
+}
+
+// Whether [offset, offset + size) lies within a section of total bytes or
+// records.
+bool fits(uint64_t offset, uint64_t size, uint64_t total)
+{
+    return offset <= total && size <= total - offset;
+}
+
+bool ends_with(const std::string& text, const std::string& suffix)
+{
+    return text.size() >= suffix.size() &&
+           text.compare(text.size() - suffix.size(), suffix.size(), suffix) ==
+               0;
+}
+
+std::string with_slash(const std::string& dir)
+{
+    return dir.back() == '/' ? dir : dir + "/";
+}
+
+// The start of a user message, on one line.
+std::string make_snippet(std::string_view user)
+{
+    std::string text(user.substr(0, search::SNIPPET_SIZE));
+    std::replace_if(text.begin(), text.end(),
+                    [](unsigned char c) { return std::isspace(c); }, ' ');
+    if (user.size() > search::SNIPPET_SIZE)
+        text += "...";
+    return text;
+}
+} // namespace
+
+search::build_stats search::build(const std::string& dir)
+{
+    std::vector<std::string> unmatched;
+    std::vector<std::string> paths;
+    for (auto& path : io::expand_paths({dir}, unmatched))
+    {
+        if (ends_with(path, ".json"))
+            paths.push_back(std::move(path));
+    }
+    if (!unmatched.empty())
+        throw std::runtime_error("No such directory '" + dir + "'");
+
+    std::vector<file_entry>  files(paths.size());
+    std::vector<std::string> names;
+    std::string              strings;
+    std::string              prefix = with_slash(dir);
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        struct stat st = {};
+        stat(paths[i].c_str(), &st);
+        names.push_back(paths[i].compare(0, prefix.size(), prefix) == 0
+                            ? paths[i].substr(prefix.size())
+                            : paths[i]);
+        files[i] = {st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (uint64_t)st.st_size,
+                    (uint32_t)strings.size(), (uint32_t)names[i].size()};
+        strings += names[i];
+    }
+
+    build_stats stats;
+    stats.files            = paths.size();
+    std::string index_path = dir + "/" + INDEX_FILE_NAME;
+    try
+    {
+        io::mapping old(index_path);
+        file_header header;
+        if (old.size() >= sizeof(header))
+        {
+            memcpy(&header, old.data(), sizeof(header));
+            const uint8_t* old_files =
+                reinterpret_cast<const uint8_t*>(old.data()) + sizeof(header);
+            const char* old_strings =
+                old.data() + old.size() - header.strings_size;
+            bool same = !memcmp(header.magic, MAGIC, sizeof(MAGIC)) &&
+                        expected_size(header) == old.size() &&
+                        header.file_count == files.size();
+            for (size_t i = 0; same && i < files.size(); i++)
+            {
+                file_entry entry = record<file_entry>(old_files, i);
+                same = fits(entry.path_offset, entry.path_size,
+                            header.strings_size) &&
+                       entry.mtime_sec == files[i].mtime_sec &&
+                       entry.mtime_nsec == files[i].mtime_nsec &&
+                       entry.size == files[i].size &&
+                       std::string_view(old_strings + entry.path_offset,
+                                        entry.path_size) == names[i];
+            }
+            if (same)
+            {
+                stats.exchanges = header.doc_count;
+                stats.terms     = header.term_count;
+                return stats;
+            }
+        }
+    }
+    catch (const std::exception&)
+    {
+        // Missing or unreadable, so rebuild
+    }
+
+    std::vector<doc_entry>                                 docs;
+    std::unordered_map<std::string, std::vector<posting>> postings;
+    std::unordered_map<std::string, uint32_t>             counts;
+    io::read_limits                                        limits;
+    limits.max_file_size = 256 << 20;
+    size_t file_index    = 0;
+    auto   count_term    = [&](std::string_view term)
+    { counts[std::string(term)]++; };
+    io::read_files(
+        paths, limits,
+        [&](io::file_contents& file)
+        {
+            uint32_t file_id = file_index++;
+            if (file.status != io::read_status::OK)
+                return;
+            nlohmann::json j =
+                nlohmann::json::parse(file.text(), nullptr, false);
+            if (!j.is_object() || !j.contains("messages") ||
+                !j["messages"].is_array())
+                return;
+
+            // Exchanges pair each user message with the reply after it, the
+            // same way a conversation is imported
+            std::string user;
+            bool        have_user = false;
+            uint32_t    exchange  = 0;
+            for (const auto& msg : j["messages"])
+            {
+                if (!msg.is_object() || !msg.contains("role") ||
+                    !msg.contains("content") || !msg["role"].is_string() ||
+                    !msg["content"].is_string())
+                    continue;
+                const auto& role = msg["role"].get_ref<const std::string&>();
+                const auto& content =
+                    msg["content"].get_ref<const std::string&>();
+                if (role == "user")
+                {
+                    user      = content;
+                    have_user = true;
+                    continue;
+                }
+                if (role != "assistant" || !have_user)
+                    continue;
+                have_user = false;
+
+                uint32_t    doc_id  = docs.size();
+                std::string snippet = make_snippet(user);
+                docs.push_back({file_id, exchange++, (uint32_t)strings.size(),
+                                (uint32_t)snippet.size()});
+                strings += snippet;
+                counts.clear();
+                for_each_term(user, count_term);
+                for_each_term(content, count_term);
+                for (const auto& count : counts)
+                    postings[count.first].push_back(
+                        {doc_id, count.second});
+            }
+        });
+
+    std::vector<const std::pair<const std::string, std::vector<posting>>*>
+        sorted;
+    sorted.reserve(postings.size());
+    for (const auto& entry : postings)
+        sorted.push_back(&entry);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const auto* a, const auto* b) { return a->first < b->first; });
+
+    std::vector<term_entry> terms;
+    terms.reserve(sorted.size());
+    uint32_t posting_count = 0;
+    for (const auto* entry : sorted)
+    {
+        terms.push_back({(uint32_t)strings.size(),
+                         (uint32_t)entry->first.size(), posting_count,
+                         (uint32_t)entry->second.size()});
+        strings += entry->first;
+        posting_count += entry->second.size();
+    }
+
+    file_header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.file_count    = files.size();
+    header.doc_count     = docs.size();
+    header.term_count    = terms.size();
+    header.posting_count = posting_count;
+    header.strings_size  = strings.size();
+
+    // Written aside and renamed, so readers never map a partial index
+    std::string temp_path = index_path + ".tmp";
+    FILE*       out       = fopen(temp_path.c_str(), "wb");
+    if (!out)
+        throw std::runtime_error("Failed to write '" + temp_path +
+                                 "': " + strerror(errno));
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(files.data(), sizeof(file_entry), files.size(), out);
+    fwrite(docs.data(), sizeof(doc_entry), docs.size(), out);
+    fwrite(terms.data(), sizeof(term_entry), terms.size(), out);
+    for (const auto* entry : sorted)
+        fwrite(entry->second.data(), sizeof(posting), entry->second.size(),
+               out);
+    fwrite(strings.data(), 1, strings.size(), out);
+    bool written = !ferror(out);
+    if (fclose(out) != 0 || !written ||
+        rename(temp_path.c_str(), index_path.c_str()) != 0)
+    {
+        remove(temp_path.c_str());
+        throw std::runtime_error("Failed to write '" + index_path + "'");
+    }
+
+    stats.exchanges = docs.size();
+    stats.terms     = terms.size();
+    stats.rebuilt   = true;
+    return stats;
+}
+
+// search::index
+search::index::index(const std::string& dir)
+    : map_(dir + "/" + INDEX_FILE_NAME), dir_(with_slash(dir))
+{
+    file_header header;
+    if (map_.size() < sizeof(header))
+        throw std::runtime_error("Corrupt index in '" + dir + "'");
+    memcpy(&header, map_.data(), sizeof(header));
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) ||
+        expected_size(header) != map_.size())
+        throw std::runtime_error("Corrupt index in '" + dir + "'");
+
+    base_       = reinterpret_cast<const uint8_t*>(map_.data());
+    file_count_ = header.file_count;
+    doc_count_  = header.doc_count;
+    term_count_ = header.term_count;
+    files_      = base_ + sizeof(header);
+    docs_       = files_ + file_count_ * sizeof(file_entry);
+    terms_      = docs_ + doc_count_ * sizeof(doc_entry);
+    postings_   = terms_ + term_count_ * sizeof(term_entry);
+    strings_    = postings_ + header.posting_count * sizeof(posting);
+
+    // Every offset and id is checked once here, so find can trust them
+    bool valid = true;
+    for (uint32_t i = 0; valid && i < file_count_; i++)
+    {
+        file_entry file = record<file_entry>(files_, i);
+        valid = fits(file.path_offset, file.path_size, header.strings_size);
+    }
+    for (uint32_t i = 0; valid && i < doc_count_; i++)
+    {
+        doc_entry doc = record<doc_entry>(docs_, i);
+        valid = doc.file < file_count_ &&
+                fits(doc.snippet_offset, doc.snippet_size, header.strings_size);
+    }
+    for (uint32_t i = 0; valid && i < term_count_; i++)
+    {
+        term_entry term = record<term_entry>(terms_, i);
+        valid = term.posting_count > 0 &&
+                fits(term.text_offset, term.text_size, header.strings_size) &&
+                fits(term.first_posting, term.posting_count,
+                     header.posting_count);
+    }
+    for (uint32_t i = 0; valid && i < header.posting_count; i++)
+        valid = record<posting>(postings_, i).doc < doc_count_;
+    if (!valid)
+        throw std::runtime_error("Corrupt index in '" + dir + "'");
+}
+
+std::string_view search::index::term_at(uint32_t i) const
+{
+    term_entry term = record<term_entry>(terms_, i);
+    return {reinterpret_cast<const char*>(strings_) + term.text_offset,
+            term.text_size};
+}
+
+std::vector<search::hit> search::index::find(std::string_view query,
+                                             size_t           limit) const
+{
+    std::vector<std::string> words;
+    for_each_term(query,
+                  [&](std::string_view term) { words.emplace_back(term); });
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+    if (words.empty())
+        return {};
+
+    std::vector<term_entry> matched;
+    for (const auto& word : words)
+    {
+        uint32_t low = 0, high = term_count_;
+        while (low < high)
+        {
+            uint32_t mid = low + (high - low) / 2;
+            if (term_at(mid) < word)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if (low == term_count_ || term_at(low) != word)
+            return {};
+        matched.push_back(record<term_entry>(terms_, low));
+    }
+    std::sort(matched.begin(), matched.end(),
+              [](const term_entry& a, const term_entry& b)
+              { return a.posting_count < b.posting_count; });
+
+    // Walk the rarest term's postings, binary searching the others
+    std::vector<std::pair<double, uint32_t>> scored;
+    const term_entry& rarest = matched.front();
+    for (uint32_t p = 0; p < rarest.posting_count; p++)
+    {
+        posting first = record<posting>(postings_, rarest.first_posting + p);
+        double  score = 0;
+        bool    all   = true;
+        for (const auto& term : matched)
+        {
+            uint32_t low = term.first_posting,
+                     high = term.first_posting + term.posting_count;
+            while (low < high)
+            {
+                uint32_t mid = low + (high - low) / 2;
+                if (record<posting>(postings_, mid).doc < first.doc)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            posting found;
+            if (low == term.first_posting + term.posting_count ||
+                (found = record<posting>(postings_, low)).doc != first.doc)
+            {
+                all = false;
+                break;
+            }
+            score += found.count *
+                     std::log(1.0 + (double)doc_count_ / term.posting_count);
+        }
+        if (all)
+            scored.emplace_back(score, first.doc);
+    }
+
+    size_t count = std::min(limit, scored.size());
+    std::partial_sort(scored.begin(), scored.begin() + count, scored.end(),
+                      [](const auto& a, const auto& b)
+                      { return a.first > b.first; });
+
+    const char*      strings = reinterpret_cast<const char*>(strings_);
+    std::vector<hit> hits;
+    for (size_t i = 0; i < count; i++)
+    {
+        doc_entry  doc  = record<doc_entry>(docs_, scored[i].second);
+        file_entry file = record<file_entry>(files_, doc.file);
+        hits.push_back(
+            {dir_ + std::string(strings + file.path_offset, file.path_size),
+             doc.exchange, scored[i].first,
+             std::string(strings + doc.snippet_offset, doc.snippet_size)});
+    }
+    return hits;
+}
@@ -0,0 +1,83 @@
+#ifndef LJ_SEARCH_H
+#define LJ_SEARCH_H
+
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "io.h"
+
+namespace search
+{
+const std::string INDEX_FILE_NAME = ".jipitty-index";
+constexpr size_t  MIN_TERM_SIZE   = 2;
+constexpr size_t  MAX_TERM_SIZE   = 64;
+constexpr size_t  SNIPPET_SIZE    = 72;
+
+// Calls fn with every lower case run of letters, digits and underscores.
+template <typename Fn> void for_each_term(std::string_view text, Fn&& fn)
+{
+    char   term[MAX_TERM_SIZE];
+    size_t size = 0;
+    bool   long_run = false;
+    for (size_t i = 0; i <= text.size(); i++)
+    {
+        unsigned char c = i < text.size() ? text[i] : ' ';
+        if (std::isalnum(c) || c == '_')
+        {
+            if (size < MAX_TERM_SIZE)
+                term[size++] = std::tolower(c);
+            else
+                long_run = true;
+            continue;
+        }
+        if (size >= MIN_TERM_SIZE && !long_run)
+            fn(std::string_view(term, size));
+        size     = 0;
+        long_run = false;
+    }
+}
+
+struct hit
+{
+    std::string path;         // Under the indexed directory
+    uint32_t    exchange = 0; // Zero based
+    double      score    = 0;
+    std::string snippet; // The start of the user message, on one line
+};
+
+struct build_stats
+{
+    size_t files     = 0;
+    size_t exchanges = 0;
+    size_t terms     = 0;
+    bool   rebuilt   = false;
+};
+
+// Indexes every .json conversation export under dir into dir/.jipitty-index,
+// unless the index already matches the files' sizes and mtimes.
+build_stats build(const std::string& dir);
+
+// A read-only view of a mapped index file.
+class index
+{
+public:
+    explicit index(const std::string& dir);
+
+    // Exchanges containing every query term, best tf-idf score first.
+    std::vector<hit> find(std::string_view query, size_t limit) const;
+    size_t           exchange_count() const { return doc_count_; }
+
+private:
+    std::string_view term_at(uint32_t i) const;
+
+    io::mapping    map_;
+    std::string    dir_; // Prefixed to the stored paths
+    const uint8_t* base_ = nullptr;
+    uint32_t       file_count_ = 0, doc_count_ = 0, term_count_ = 0;
+    const uint8_t *files_ = nullptr, *docs_ = nullptr, *terms_ = nullptr,
+                  *postings_ = nullptr, *strings_ = nullptr;
+};
+} // namespace search
+#endif
@@ -0,0 +1,307 @@
+#include "server.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+static std::string lower(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return text;
+}
+
+static std::string trim(const std::string& text)
+{
+    size_t first = text.find_first_not_of(" \t");
+    if (first == std::string::npos)
+        return "";
+    return text.substr(first, text.find_last_not_of(" \t") - first + 1);
+}
+
+const char* net::status_reason(int status)
+{
+    switch (status)
+    {
+    case 100:
+        return "Continue";
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 401:
+        return "Unauthorized";
+    case 404:
+        return "Not Found";
+    case 411:
+        return "Length Required";
+    case 413:
+        return "Payload Too Large";
+    case 429:
+        return "Too Many Requests";
+    case 500:
+        return "Internal Server Error";
+    case 502:
+        return "Bad Gateway";
+    case 503:
+        return "Service Unavailable";
+    default:
+        return "Unknown";
+    }
+}
+
+// net::incoming_request
+const std::string* net::incoming_request::header(std::string_view name) const
+{
+    for (const auto& header : headers)
+    {
+        if (header.first == name)
+            return &header.second;
+    }
+    return nullptr;
+}
+
+bool net::incoming_request::keep_alive() const
+{
+    const std::string* connection = header("connection");
+    if (connection)
+        return lower(*connection) != "close";
+    return version == "HTTP/1.1";
+}
+
+// net::server_connection
+net::server_connection::server_connection(
+    net::server_connection&& other) noexcept
+    : fd_(other.fd_), buffer_(std::move(other.buffer_))
+{
+    other.fd_ = -1;
+}
+
+net::server_connection::~server_connection()
+{
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+bool net::server_connection::fill()
+{
+    char block[1 << 14];
+    while (true)
+    {
+        ssize_t got = ::read(fd_, block, sizeof(block));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        buffer_.append(block, got);
+        return true;
+    }
+}
+
+bool net::server_connection::write_all(std::string_view data)
+{
+    while (!data.empty())
+    {
+        ssize_t written = ::send(fd_, data.data(), data.size(), MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data.remove_prefix(written);
+    }
+    return true;
+}
+
+bool net::server_connection::read_request(net::incoming_request& out)
+{
+    size_t head_end;
+    while ((head_end = buffer_.find("\r\n\r\n")) == std::string::npos)
+    {
+        if (buffer_.size() > MAX_HEADER_SIZE)
+        {
+            send_response(400, {}, "");
+            return false;
+        }
+        if (!fill())
+            return false;
+    }
+
+    out = incoming_request();
+    size_t line_end = buffer_.find("\r\n");
+    {
+        std::string request_line = buffer_.substr(0, line_end);
+        size_t      first        = request_line.find(' ');
+        size_t      second       = request_line.rfind(' ');
+        if (first == std::string::npos || second == first)
+        {
+            send_response(400, {}, "");
+            return false;
+        }
+        out.method  = request_line.substr(0, first);
+        out.target  = request_line.substr(first + 1, second - first - 1);
+        out.version = request_line.substr(second + 1);
+    }
+    while (line_end < head_end)
+    {
+        size_t start = line_end + 2;
+        line_end     = buffer_.find("\r\n", start);
+        std::string line  = buffer_.substr(start, line_end - start);
+        size_t      colon = line.find(':');
+        if (colon != std::string::npos)
+            out.headers.emplace_back(lower(trim(line.substr(0, colon))),
+                                     trim(line.substr(colon + 1)));
+    }
+    buffer_.erase(0, head_end + 4);
+
+    if (out.header("transfer-encoding"))
+    {
+        send_response(411, {{"Connection", "close"}}, "");
+        return false;
+    }
+    const std::string* length_header = out.header("content-length");
+    size_t             length =
+        length_header ? strtoull(length_header->c_str(), nullptr, 10) : 0;
+    if (length > MAX_BODY_SIZE)
+    {
+        send_response(413, {{"Connection", "close"}}, "");
+        return false;
+    }
+    const std::string* expect = out.header("expect");
+    if (length && expect && lower(*expect) == "100-continue" &&
+        buffer_.size() < length &&
+        !write_all("HTTP/1.1 100 Continue\r\n\r\n"))
+        return false;
+    while (buffer_.size() < length)
+    {
+        if (!fill())
+            return false;
+    }
+    out.body = buffer_.substr(0, length);
+    buffer_.erase(0, length);
+    return true;
+}
+
+bool net::server_connection::write_head(int status, const header_list& headers,
+                                        std::string_view framing)
+{
+    std::string head = "HTTP/1.1 " + std::to_string(status) + " " +
+                       status_reason(status) + "\r\n";
+    for (const auto& header : headers)
+        head += header.first + ": " + header.second + "\r\n";
+    head.append(framing);
+    head += "\r\n";
+    return write_all(head);
+}
+
+bool net::server_connection::send_response(int status,
+                                           const header_list& headers,
+                                           std::string_view   body)
+{
+    return write_head(status, headers,
+                      "Content-Length: " + std::to_string(body.size()) +
+                          "\r\n") &&
+           write_all(body);
+}
+
+bool net::server_connection::begin_stream(int                status,
+                                          const header_list& headers)
+{
+    return write_head(status, headers, "Transfer-Encoding: chunked\r\n");
+}
+
+bool net::server_connection::send_chunk(std::string_view data)
+{
+    if (data.empty())
+        return true;
+    char size[20];
+    snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    return write_all(size) && write_all(data) && write_all("\r\n");
+}
+
+bool net::server_connection::end_stream() { return write_all("0\r\n\r\n"); }
+
+void net::server_connection::shutdown()
+{
+    if (fd_ >= 0)
+        ::shutdown(fd_, SHUT_RDWR);
+}
+
+// net::server
+net::server::server(const std::string& address)
+{
+    size_t      colon = address.rfind(':');
+    std::string host =
+        colon == std::string::npos ? "" : address.substr(0, colon);
+    std::string port =
+        colon == std::string::npos ? address : address.substr(colon + 1);
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    // Loopback unless a host is named, so nothing is reachable from the
+    // network by accident
+    if (host.empty())
+        host = "127.0.0.1";
+
+    addrinfo hints = {}, *found = nullptr;
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+    if (rc != 0)
+        throw std::runtime_error("Bad address '" + address +
+                                 "': " + gai_strerror(rc));
+
+    std::string error = "no usable address";
+    for (addrinfo* ai = found; ai && fd_ < 0; ai = ai->ai_next)
+    {
+        fd_ = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                     ai->ai_protocol);
+        if (fd_ < 0)
+            continue;
+        int yes = 1;
+        setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd_, ai->ai_addr, ai->ai_addrlen) != 0 ||
+            listen(fd_, SOMAXCONN) != 0)
+        {
+            error = strerror(errno);
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (fd_ < 0)
+        throw std::runtime_error("Failed to listen on '" + address +
+                                 "': " + error);
+}
+
+net::server::~server()
+{
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+net::server_connection net::server::accept()
+{
+    while (true)
+    {
+        int fd = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0)
+        {
+            // Heads, bodies and chunk frames go out as separate writes, which
+            // Nagle would hold back until the client's delayed ACK
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            return server_connection(fd);
+        }
+        if (errno != EINTR && errno != ECONNABORTED)
+            throw std::runtime_error(std::string("Failed to accept: ") +
+                                     strerror(errno));
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef LJ_SERVER_H
+#define LJ_SERVER_H
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace net
+{
+constexpr size_t MAX_HEADER_SIZE = 64 << 10;
+constexpr size_t MAX_BODY_SIZE   = 64 << 20;
+
+using header_list = std::vector<std::pair<std::string, std::string>>;
+
+struct incoming_request
+{
+    std::string method, target, version;
+    header_list headers; // Names lower case
+    std::string body;
+
+    const std::string* header(std::string_view name) const;
+    bool               keep_alive() const;
+};
+
+// One HTTP/1.1 client connection, closed on destruction.
+class server_connection
+{
+public:
+    explicit server_connection(int fd) : fd_(fd) {}
+    server_connection(const server_connection&)            = delete;
+    server_connection& operator=(const server_connection&) = delete;
+    server_connection(server_connection&& other) noexcept;
+    ~server_connection();
+
+    // False at the end of the connection or after answering a bad request.
+    bool read_request(incoming_request& out);
+
+    bool send_response(int status, const header_list& headers,
+                       std::string_view body);
+    // A chunked response whose body follows in send_chunk calls.
+    bool begin_stream(int status, const header_list& headers);
+    bool send_chunk(std::string_view data);
+    bool end_stream();
+
+    // Ends the connection for both sides, waking a blocked read.
+    void shutdown();
+
+private:
+    bool fill();
+    bool write_all(std::string_view data);
+    bool write_head(int status, const header_list& headers,
+                    std::string_view framing);
+
+    int         fd_ = -1;
+    std::string buffer_; // Read but not yet consumed
+};
+
+class server
+{
+public:
+    // [host:]port, loopback only when the host is omitted. 0.0.0.0 or [::]
+    // listens on every interface.
+    explicit server(const std::string& address);
+    server(const server&)            = delete;
+    server& operator=(const server&) = delete;
+    ~server();
+
+    server_connection accept();
+
+private:
+    int fd_ = -1;
+};
+
+const char* status_reason(int status);
+} // namespace net
+#endif